@@ -0,0 +1,79 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "bufpool.h"
+
+/* Every buffer starts with this, padded so the data stays 64 byte aligned */
+struct bufpool_block_s {
+ struct bufpool_block_s *next;
+ size_t size;
+};
+#define BLOCK_HEADER 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_block_s *free_list;
+static unsigned free_count;
+
+BYTE *bufpool_get(size_t size) {
+    struct bufpool_block_s *b, **p, **best = NULL;
+
+    // the smallest free one that fits, unless it would waste half of itself
+    pthread_mutex_lock(&lock);
+    for (p = &free_list; *p != NULL; p = &(*p)->next) {
+        if ((*p)->size >= size && (*p)->size / 2 <= size && (best == NULL || (*p)->size < (*best)->size))
+            best = p;
+    }
+    if (best != NULL) {
+        b = *best;
+        *best = b->next;
+        free_count--;
+        pthread_mutex_unlock(&lock);
+        return (BYTE*)b + BLOCK_HEADER;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (posix_memalign((void**)&b, BLOCK_HEADER, BLOCK_HEADER + size) != 0)
+        return NULL;
+    b->size = size;
+    dbgprint("bufpool: new %zu byte buffer\n", size);
+    return (BYTE*)b + BLOCK_HEADER;
+}
+
+void bufpool_put(BYTE *p) {
+    struct bufpool_block_s *b;
+
+    if (p == NULL)
+        return;
+    b = (struct bufpool_block_s*)(p - BLOCK_HEADER);
+    pthread_mutex_lock(&lock);
+    if (free_count < BUFPOOL_MAX_FREE) {
+        b->next = free_list;
+        free_list = b;
+        free_count++;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    free(b);
+}
+
+void bufpool_trim(void) {
+    struct bufpool_block_s *b;
+
+    pthread_mutex_lock(&lock);
+    while ((b = free_list) != NULL) {
+        free_list = b->next;
+        free(b);
+    }
+    free_count = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,28 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+typedef unsigned char BYTE;
+
+/* Frame sized buffers shared by every stream of the process. A buffer that
+ * is put back is handed out again to the next stream (or reconnect) that
+ * asks for as much, instead of going back to the system and being faulted
+ * in afresh. Safe to use from any thread. */
+#define BUFPOOL_MAX_FREE 32
+
+BYTE *bufpool_get(size_t size);
+void  bufpool_put(BYTE *p);
+/* Returns the free buffers to the system */
+void  bufpool_trim(void);
+
+#endif
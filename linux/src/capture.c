@@ -0,0 +1,282 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "capture.h"
+#include "connection.h"
+#include "decoder.h"
+
+struct capture_s {
+ FILE *fp;
+ char header[5];
+ uint64_t first_arrival;
+ uint64_t offset;       /* of the next record */
+ uint64_t *index;
+ unsigned count, alloc;
+};
+
+static struct capture_s capture;
+
+static void put32(BYTE *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put64(BYTE *p, uint64_t v) {
+    put32(p, (uint32_t)v);
+    put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get32(const BYTE *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const BYTE *p) {
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void write_header(BYTE *h, const char *header, unsigned count, uint64_t index_offset) {
+    memset(h, 0, CAPTURE_HEADER_SIZE);
+    memcpy(h, CAPTURE_MAGIC, 4);
+    put32(h + 4, CAPTURE_VERSION);
+    memcpy(h + 8, header, 5);
+    put32(h + 16, count);
+    put64(h + 20, index_offset);
+}
+
+int capture_start(const char *path, const char *header) {
+    BYTE h[CAPTURE_HEADER_SIZE];
+
+    capture.fp = fopen(path, "wb");
+    if (capture.fp == NULL) {
+        MSG_LASTERROR("Error: capture file");
+        return FALSE;
+    }
+    setvbuf(capture.fp, NULL, _IOFBF, 1 << 20);
+    memcpy(capture.header, header, 5);
+    write_header(h, header, 0, 0);
+    fwrite(h, 1, CAPTURE_HEADER_SIZE, capture.fp);
+    capture.offset = CAPTURE_HEADER_SIZE;
+    capture.count = 0;
+    capture.first_arrival = 0;
+    errprint("capturing to %s\n", path);
+    return TRUE;
+}
+
+int capture_active(void) {
+    return capture.fp != NULL;
+}
+
+void capture_frame(const BYTE *data, unsigned length, uint64_t arrival) {
+    BYTE rec[CAPTURE_RECORD_SIZE];
+
+    if (capture.fp == NULL)
+        return;
+    if (capture.count == capture.alloc) {
+        unsigned alloc = capture.alloc ? capture.alloc * 2 : 1024;
+        uint64_t *index = realloc(capture.index, alloc * sizeof(uint64_t));
+        if (index == NULL) {
+            errprint("capture: out of memory, stopping\n");
+            capture_stop();
+            return;
+        }
+        capture.index = index;
+        capture.alloc = alloc;
+    }
+
+    if (capture.count == 0)
+        capture.first_arrival = arrival;
+    put64(rec, arrival - capture.first_arrival);
+    put32(rec + 8, length);
+    if (fwrite(rec, 1, CAPTURE_RECORD_SIZE, capture.fp) != CAPTURE_RECORD_SIZE
+        || fwrite(data, 1, length, capture.fp) != length) {
+        MSG_LASTERROR("Error: capture write");
+        capture_stop();
+        return;
+    }
+    capture.index[capture.count++] = capture.offset;
+    capture.offset += CAPTURE_RECORD_SIZE + length;
+}
+
+void capture_stop(void) {
+    BYTE h[CAPTURE_HEADER_SIZE], e[8];
+    unsigned i;
+
+    if (capture.fp == NULL)
+        return;
+
+    for (i = 0; i < capture.count; i++) {
+        put64(e, capture.index[i]);
+        fwrite(e, 1, 8, capture.fp);
+    }
+    write_header(h, capture.header, capture.count, capture.offset);
+    if (fseek(capture.fp, 0, SEEK_SET) < 0 || fwrite(h, 1, CAPTURE_HEADER_SIZE, capture.fp) != CAPTURE_HEADER_SIZE)
+        MSG_LASTERROR("Error: capture index");
+    fclose(capture.fp);
+    capture.fp = NULL;
+    errprint("captured %u frames\n", capture.count);
+
+    free(capture.index);
+    capture.index = NULL;
+    capture.alloc = 0;
+}
+
+/* For a file whose capture was not stopped cleanly */
+static int replay_scan(struct replay_s *r) {
+    uint64_t off = CAPTURE_HEADER_SIZE, len;
+    unsigned alloc = 0;
+    uint64_t *index;
+
+    r->count = 0;
+    while (off + CAPTURE_RECORD_SIZE <= r->size) {
+        len = get32(r->map + off + 8);
+        if (off + CAPTURE_RECORD_SIZE + len > r->size)
+            break;
+        if (r->count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            index = realloc(r->index, alloc * sizeof(uint64_t));
+            if (index == NULL)
+                return FALSE;
+            r->index = index;
+        }
+        r->index[r->count++] = off;
+        off += CAPTURE_RECORD_SIZE + len;
+    }
+    return TRUE;
+}
+
+int replay_open(struct replay_s *r, const char *path) {
+    struct stat st;
+    uint64_t index_offset;
+    unsigned i;
+    int fd = open(path, O_RDONLY);
+
+    memset(r, 0, sizeof(struct replay_s));
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        MSG_LASTERROR("Error: replay file");
+        if (fd >= 0) close(fd);
+        return FALSE;
+    }
+    r->size = st.st_size;
+    r->map = (r->size >= CAPTURE_HEADER_SIZE)
+        ? (BYTE*)mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (r->map == MAP_FAILED || memcmp(r->map, CAPTURE_MAGIC, 4) != 0
+        || get32(r->map + 4) != CAPTURE_VERSION) {
+        errprint("%s: not a droidcam capture\n", path);
+        if (r->map != MAP_FAILED) munmap(r->map, r->size);
+        r->map = NULL;
+        return FALSE;
+    }
+    madvise(r->map, r->size, MADV_SEQUENTIAL);
+    memcpy(r->header, r->map + 8, 5);
+
+    r->count = get32(r->map + 16);
+    index_offset = get64(r->map + 20);
+    // every entry has to point at a whole record between the header and
+    // the index; written so that no bad value can wrap around
+    if (index_offset >= CAPTURE_HEADER_SIZE && index_offset <= r->size
+        && r->count <= (r->size - index_offset) / 8) {
+        r->index = (uint64_t*)malloc(((size_t)r->count + 1) * sizeof(uint64_t));
+        for (i = 0; r->index != NULL && i < r->count; i++) {
+            r->index[i] = get64(r->map + index_offset + (uint64_t)i * 8);
+            if (r->index[i] < CAPTURE_HEADER_SIZE || r->index[i] > index_offset - CAPTURE_RECORD_SIZE
+                || get32(r->map + r->index[i] + 8) > index_offset - CAPTURE_RECORD_SIZE - r->index[i])
+                break;
+        }
+        if (r->index != NULL && i == r->count)
+            return TRUE;
+        free(r->index);
+        r->index = NULL;
+    }
+
+    errprint("%s: no index, scanning\n", path);
+    if (!replay_scan(r)) {
+        replay_close(r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Wait for the decoder to be done with every frame handed to it. FALSE if
+ * stopped first. */
+int replay_drain(struct decoder_s *d) {
+    while (!decoder_drain(d, 100)) {
+        if (connection_stopped())
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Hands the next frame to the decoder the way recv_video_frame() would.
+ * Returns FALSE at the end of the capture, or once stopped. */
+int replay_video_frame(struct decoder_s *d, struct replay_s *r, int fast) {
+    const BYTE *rec;
+    uint64_t arrival, due, now;
+    unsigned length;
+    struct jpg_frame_s *f;
+
+    if (r->next >= r->count)
+        return FALSE;
+    rec = r->map + r->index[r->next];
+    arrival = get64(rec);
+    length = get32(rec + 8);
+
+    if (fast) {
+        // one frame at a time, so none is ever dropped and runs repeat
+        if (!replay_drain(d))
+            return FALSE;
+    } else {
+        if (r->next == 0)
+            r->start_us = now_us();
+        due = r->start_us + arrival;
+        now = now_us();
+        if (due > now) {
+            // on the stop fd, so a stop doesn't wait out a pause in the capture
+            struct pollfd pfd = { .fd = connection_stop_fd(), .events = POLLIN };
+            struct timespec ts = { .tv_sec = (due - now) / 1000000, .tv_nsec = (due - now) % 1000000 * 1000 };
+            ppoll(&pfd, 1, &ts, NULL);
+        }
+        if (connection_stopped())
+            return FALSE;
+    }
+
+    f = decoder_get_next_frame(d);
+    if (!decoder_begin_frame(d, f, length))
+        return FALSE;
+    memcpy(f->data, rec + CAPTURE_RECORD_SIZE, length);
+    decoder_frame_progress(d, f, length);
+    decoder_put_next_frame(d);
+    r->next++;
+    return TRUE;
+}
+
+void replay_close(struct replay_s *r) {
+    if (r->map != NULL)
+        munmap(r->map, r->size);
+    free(r->index);
+    memset(r, 0, sizeof(struct replay_s));
+}
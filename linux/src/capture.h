@@ -0,0 +1,56 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned char BYTE;
+
+/* Recorded video stream. All numbers are little endian.
+ *
+ *   header   "DCAP", u32 version, the 5 byte video header + 3 pad bytes,
+ *            u32 frame count, u64 index offset, u32 reserved
+ *   frames   u64 arrival usecs since the first frame, u32 length, JPEG
+ *   index    u64 file offset of every frame record
+ *
+ * The count and index are filled in when the capture is stopped; a file
+ * without them is still read by scanning the frame records. */
+#define CAPTURE_MAGIC       "DCAP"
+#define CAPTURE_VERSION     1
+#define CAPTURE_HEADER_SIZE 32
+#define CAPTURE_RECORD_SIZE 12
+
+/* Network thread: record the stream as it is received */
+int  capture_start(const char *path, const char *header);
+int  capture_active(void);
+void capture_frame(const BYTE *data, unsigned length, uint64_t arrival);
+void capture_stop(void);
+
+struct replay_s {
+ BYTE *map;
+ size_t size;
+ char header[5];
+ uint64_t *index;       /* record offsets */
+ unsigned count;
+ unsigned next;
+ uint64_t start_us;
+};
+
+/* Feeds a capture to the decoder in place of the phone, at the recorded
+ * pace, or with 'fast' as quickly as every frame can be decoded */
+int  replay_open(struct replay_s *r, const char *path);
+struct decoder_s;
+int  replay_video_frame(struct decoder_s *d, struct replay_s *r, int fast);
+int  replay_drain(struct decoder_s *d);
+void replay_close(struct replay_s *r);
+
+#endif
@@ -8,41 +8,193 @@
  */
 
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "common.h"
+#include "bufpool.h"
+#include "capture.h"
 #include "connection.h"
+#include "decoder.h"
+#include "trace.h"
+#include "uring.h"
 
-SOCKET wifiServerSocket = INVALID_SOCKET;
-extern int v_running;
+/* Listening sockets, one per port, so several streams can each wait for
+ * their phone in one process */
+#define MAX_SERVERS 16
+static struct {
+ int port;
+ SOCKET fd;
+} servers[MAX_SERVERS];
+static int server_count;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint connections;  /* established, for the stats */
+
+/* Wakes the threads waiting on a phone. 'stop_fd' stays readable from
+ * connection_stop() until connection_start(), so it ends every wait there
+ * is. */
+static int stop_fd = -1;
+static atomic_int stopping;
+static _Atomic uint64_t stop_time;  /* CLOCK_MONOTONIC ns of the stop */
+static pthread_once_t events_once = PTHREAD_ONCE_INIT;
+
+/* The recv_buf streams running, for connection_control() */
+static struct recv_buf_s *streams;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void events_init(void)
+{
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd < 0)
+        MSG_LASTERROR("Error: eventfd");
+}
+
+void connection_start(void)
+{
+    uint64_t v;
+
+    pthread_once(&events_once, events_init);
+    atomic_store(&stopping, 0);
+    if (read(stop_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        MSG_LASTERROR("Error: eventfd");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void connection_stop(void)
+{
+    uint64_t v = 1;
+
+    if (atomic_exchange(&stopping, 1) == 0)
+        atomic_store(&stop_time, now_ns());
+    if (stop_fd >= 0 && write(stop_fd, &v, sizeof(v)) < 0)
+        return;
+}
+
+int connection_stopped(void)
+{
+    return atomic_load_explicit(&stopping, memory_order_relaxed);
+}
+
+int connection_stop_fd(void)
+{
+    pthread_once(&events_once, events_init);
+    return stop_fd;
+}
+
+double connection_stop_ms(void)
+{
+    if (!connection_stopped())
+        return 0;
+    return (now_ns() - atomic_load(&stop_time)) / 1e6;
+}
+
+int connection_control(int cmd)
+{
+    int none = 0, ret = FALSE;
+    uint64_t v = 1;
+    struct recv_buf_s *r;
+
+    pthread_mutex_lock(&stream_lock);
+    r = streams;
+    if (r == NULL)
+        goto _out;
+    // with --map there is no telling which phone it is meant for
+    if (r->next != NULL) {
+        errprint("control %d: more than one stream running, not sent\n", cmd);
+        goto _out;
+    }
+    if (!atomic_compare_exchange_strong(&r->control_cmd, &none, cmd))
+        goto _out;
+    if (write(r->control_fd, &v, sizeof(v)) < 0)
+        MSG_LASTERROR("Error: eventfd");
+    ret = TRUE;
+
+_out:
+    pthread_mutex_unlock(&stream_lock);
+    return ret;
+}
+
+/* Waits for 'events' on 's', for up to 'timeout' ms. Returns 1 once they
+ * are there, 0 on a timeout and -1 when stopped. */
+static int wait_socket(SOCKET s, short events, int timeout)
+{
+    struct pollfd pfd[2];
+    int n;
+
+    pthread_once(&events_once, events_init);
+    pfd[0].fd = s;
+    pfd[0].events = events;
+    pfd[1].fd = stop_fd;
+    pfd[1].events = POLLIN;
+    do n = poll(pfd, 2, timeout);
+    while (n < 0 && errno == EINTR && !connection_stopped());
+
+    if (n < 0 || pfd[1].revents != 0 || connection_stopped())
+        return -1;
+    return (n > 0);
+}
 
 SOCKET connect_droidcam(char * ip, int port)
 {
+    int flags, err = 0;
+    socklen_t len = sizeof(err);
     struct sockaddr_in sin;
     SOCKET sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 
     printf("connecting to %s:%d\n", ip, port);
     if(sock == INVALID_SOCKET) {
         MSG_LASTERROR("Error");
-    } else {
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = inet_addr(ip);
-        sin.sin_port = htons(port);
+        goto _out;
+    }
 
-        if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-            printf("connect failed %d '%s'\n", errno, strerror(errno));
-            MSG_ERROR("Connect failed, please try again.\nCheck IP and Port.\nCheck network connection.");
-            close(sock);
-            sock = INVALID_SOCKET;
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ip);
+    sin.sin_port = htons(port);
+
+    // connect in the background, so a stop or the timeout can end it
+    flags = fcntl(sock, F_GETFL, NULL);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        if (errno != EINPROGRESS) {
+            err = errno;
+        } else if (wait_socket(sock, POLLOUT, CONNECT_TIMEOUT_MS) <= 0) {
+            err = connection_stopped() ? ECANCELED : ETIMEDOUT;
+        } else if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
         }
     }
+    fcntl(sock, F_SETFL, flags);
 
+    if (err != 0) {
+        printf("connect failed %d '%s'\n", err, strerror(err));
+        if (err != ECANCELED)
+            MSG_ERROR("Connect failed, please try again.\nCheck IP and Port.\nCheck network connection.");
+        close(sock);
+        sock = INVALID_SOCKET;
+    } else {
+        atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed);
+    }
+
+_out:
     dbgprint(" - return fd: %d\n", sock);
     return sock;
 }
@@ -51,9 +203,15 @@ int SendRecv(int doSend, char * buffer, int bytes, SOCKET s)
 {
     int retCode;
     char * ptr = buffer;
+    uint64_t t = trace_begin();
 
     while (bytes > 0) {
-        retCode = (doSend) ? send(s, ptr, bytes, 0) : recv(s, ptr, bytes, 0);
+        retCode = wait_socket(s, doSend ? POLLOUT : POLLIN, RECV_TIMEOUT_MS);
+        if (retCode <= 0) {
+            if (retCode == 0) errprint("no reply from the phone in %d ms\n", RECV_TIMEOUT_MS);
+            goto _error_out;
+        }
+        retCode = (doSend) ? send(s, ptr, bytes, MSG_NOSIGNAL) : recv(s, ptr, bytes, 0);
         if (retCode <= 0 ){ // closed or error
             goto _error_out;
         }
@@ -64,13 +222,219 @@ int SendRecv(int doSend, char * buffer, int bytes, SOCKET s)
     retCode = 1;
 
 _error_out:
+    trace_end(doSend ? "send" : "recv", t);
     return retCode;
 }
 
-static int StartInetServer(int port)
+int recv_buf_init(struct recv_buf_s *r, SOCKET s)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    pthread_once(&events_once, events_init);
+    r->s = s;
+    r->head = r->tail = 0;
+    atomic_init(&r->control_cmd, 0);
+    r->data = bufpool_get(RECV_BUF_SZ);
+    if (r->data == NULL)
+        return FALSE;
+
+    // the reads don't block, recv_buf_wait() does it for them
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, NULL) | O_NONBLOCK);
+    r->control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->control_fd < 0) {
+        MSG_LASTERROR("Error: eventfd");
+        goto _error_out;
+    }
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        MSG_LASTERROR("Error: epoll");
+        goto _control_error;
+    }
+    ev.data.fd = s;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+        goto _epoll_error;
+    ev.data.fd = stop_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, stop_fd, &ev) < 0)
+        goto _epoll_error;
+    ev.data.fd = r->control_fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->control_fd, &ev) < 0)
+        goto _epoll_error;
+
+    pthread_mutex_lock(&stream_lock);
+    r->next = streams;
+    streams = r;
+    pthread_mutex_unlock(&stream_lock);
+    return TRUE;
+
+_epoll_error:
+    MSG_LASTERROR("Error: epoll_ctl");
+    close(r->epfd);
+_control_error:
+    close(r->control_fd);
+_error_out:
+    bufpool_put(r->data);
+    r->data = NULL;
+    return FALSE;
+}
+
+void recv_buf_fini(struct recv_buf_s *r)
+{
+    struct recv_buf_s **p;
+
+    if (r->data == NULL)
+        return;
+    pthread_mutex_lock(&stream_lock);
+    for (p = &streams; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream_lock);
+    close(r->epfd);
+    close(r->control_fd);
+    bufpool_put(r->data);
+    r->data = NULL;
+}
+
+/* Sends the pending control command, if there still is one */
+static void send_control(struct recv_buf_s *r)
+{
+    char buf[32];
+    int len, cmd = atomic_exchange(&r->control_cmd, 0);
+
+    if (cmd == 0)
+        return;
+    len = snprintf(buf, sizeof(buf), OTHER_REQ, cmd);
+    dbgprint("control %d\n", cmd);
+    if (send(r->s, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+        errprint("control %d not sent\n", cmd);
+}
+
+/* Waits for the phone, a stop or a control command. FALSE if nothing came
+ * from the phone in RECV_TIMEOUT_MS. */
+static int recv_buf_wait(struct recv_buf_s *r)
+{
+    struct epoll_event ev[3];
+    uint64_t v;
+    int i, n;
+    uint64_t t = trace_begin();
+
+    n = epoll_wait(r->epfd, ev, 3, RECV_TIMEOUT_MS);
+    trace_end("wait", t);
+    if (n < 0)
+        return errno == EINTR;
+    if (n == 0) {
+        errprint("nothing from the phone in %d ms\n", RECV_TIMEOUT_MS);
+        return FALSE;
+    }
+    for (i = 0; i < n; i++) {
+        if (ev[i].data.fd == r->control_fd && read(r->control_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+            MSG_LASTERROR("Error: eventfd");
+    }
+    return TRUE;
+}
+
+/* One read: up to 'len' bytes to 'dst' first, if given, and whatever else
+ * is there after them to the buffer. Waits if there is nothing yet, and
+ * sends a pending control command on the way. Returns the bytes that went
+ * to 'dst', or -1 if the connection is gone or stopped. */
+static int recv_buf_fill(struct recv_buf_s *r, BYTE *dst, unsigned len)
+{
+    struct iovec iov[2];
+    int n, cnt = 0;
+    uint64_t t;
+
+    if (r->head == r->tail) {
+        r->head = r->tail = 0;
+    } else if (r->head > 0 && RECV_BUF_SZ - r->tail < RECV_BUF_SZ / 4) {
+        memmove(r->data, r->data + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head = 0;
+    }
+
+    if (dst != NULL && len > 0) {
+        iov[cnt].iov_base = dst;
+        iov[cnt].iov_len = len;
+        cnt++;
+    } else {
+        len = 0;
+    }
+    if (r->tail < RECV_BUF_SZ) {
+        iov[cnt].iov_base = r->data + r->tail;
+        iov[cnt].iov_len = RECV_BUF_SZ - r->tail;
+        cnt++;
+    }
+
+    for (;;) {
+        if (connection_stopped())
+            return -1;
+        if (atomic_load_explicit(&r->control_cmd, memory_order_relaxed) != 0)
+            send_control(r);
+
+        t = trace_begin();
+        n = readv(r->s, iov, cnt);
+        trace_end("recv", t);
+        if (n > 0)
+            break;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return -1;
+        if (errno != EINTR && !recv_buf_wait(r))
+            return -1;
+    }
+
+    if ((unsigned)n <= len)
+        return n;
+    r->tail += n - len;
+    return len;
+}
+
+/* Receives one length-prefixed JPEG frame into the decoder's next slot,
+ * reporting progress after every read so the decoder can start on it
+ * before it is complete. What is already buffered is copied, the rest is
+ * read in place. */
+int recv_video_frame(struct decoder_s *d, struct recv_buf_s *r)
+{
+    BYTE *buf;
+    unsigned frameLen, got;
+    int len;
+    struct jpg_frame_s *f = decoder_get_next_frame(d);
+
+    while (r->tail - r->head < 4) {
+        if (recv_buf_fill(r, NULL, 0) < 0)
+            return FALSE;
+    }
+    buf = r->data + r->head;
+    make_int4(frameLen, buf[0], buf[1], buf[2], buf[3]);
+    r->head += 4;
+    if (!decoder_begin_frame(d, f, frameLen))
+        return FALSE;
+
+    got = r->tail - r->head;
+    if (got > frameLen) got = frameLen;
+    if (got > 0) {
+        memcpy(f->data, r->data + r->head, got);
+        r->head += got;
+        decoder_frame_progress(d, f, got);
+    }
+    while (got < frameLen) {
+        if ((len = recv_buf_fill(r, f->data + got, frameLen - got)) < 0)
+            return FALSE;
+        got += len;
+        decoder_frame_progress(d, f, got);
+    }
+
+    if (capture_active())
+        capture_frame(f->data, frameLen, f->ts[FRAME_FIRST_BYTE]);
+    decoder_put_next_frame(d);
+    return TRUE;
+}
+
+static SOCKET StartInetServer(int port)
 {
     int flags = 0;
     struct sockaddr_in sin;
+    SOCKET wifiServerSocket;
 
     sin.sin_family    = AF_INET;
     sin.sin_addr.s_addr = INADDR_ANY;
@@ -103,42 +467,81 @@ static int StartInetServer(int port)
     flags |= O_NONBLOCK;
     fcntl(wifiServerSocket, F_SETFL, flags);
 
-    return 1;
+    return wifiServerSocket;
 
 _error_out:
     if (wifiServerSocket != INVALID_SOCKET){
         close(wifiServerSocket);
-        wifiServerSocket = INVALID_SOCKET;
     }
 
-    return 0;
+    return INVALID_SOCKET;
+}
+
+/* The listening socket for 'port', opened the first time it is asked for */
+static SOCKET server_socket(int port)
+{
+    int i;
+    SOCKET fd = INVALID_SOCKET;
+
+    pthread_mutex_lock(&server_lock);
+    for (i = 0; i < server_count; i++) {
+        if (servers[i].port == port) {
+            fd = servers[i].fd;
+            goto _out;
+        }
+    }
+    if (server_count == MAX_SERVERS) {
+        errprint("too many listening ports\n");
+        goto _out;
+    }
+    fd = StartInetServer(port);
+    if (fd != INVALID_SOCKET) {
+        servers[server_count].port = port;
+        servers[server_count].fd = fd;
+        server_count++;
+    }
+
+_out:
+    pthread_mutex_unlock(&server_lock);
+    return fd;
 }
 
 void connection_cleanup() {
-    if (wifiServerSocket != INVALID_SOCKET) {
-        close(wifiServerSocket);
-        wifiServerSocket = INVALID_SOCKET;
+    int i;
+
+    pthread_mutex_lock(&server_lock);
+    for (i = 0; i < server_count; i++) {
+        close(servers[i].fd);
     }
+    server_count = 0;
+    pthread_mutex_unlock(&server_lock);
+    uring_fini();
 }
 
 void disconnect(SOCKET s) {
     close(s);
 }
 
+unsigned connection_count(void) {
+    return atomic_load_explicit(&connections, memory_order_relaxed);
+}
+
 SOCKET accept_connection(int port)
 {
-    int flags;
     SOCKET client =  INVALID_SOCKET;
+    SOCKET wifiServerSocket = server_socket(port);
 
     dbgprint("serverSocket=%d\n", wifiServerSocket);
-    if (wifiServerSocket == INVALID_SOCKET && !StartInetServer(port))
+    if (wifiServerSocket == INVALID_SOCKET)
         goto _error_out;
 
     errprint("waiting on port %d..", port);
-    while(v_running && (client = accept(wifiServerSocket, NULL, NULL)) == INVALID_SOCKET)
+    while((client = accept(wifiServerSocket, NULL, NULL)) == INVALID_SOCKET)
     {
         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
-            usleep(50000);
+            // the listening socket is shared, another stream may win it
+            if (wait_socket(wifiServerSocket, POLLIN, -1) < 0)
+                break;
             continue;
         }
         MSG_LASTERROR("Accept Failed");
@@ -147,10 +550,7 @@ SOCKET accept_connection(int port)
     errprint("got socket %d\n", client);
 
     if (client != INVALID_SOCKET) {
-        // Blocking..
-        flags = fcntl(wifiServerSocket, F_GETFL, NULL);
-        flags |= O_NONBLOCK;
-        fcntl(wifiServerSocket, F_SETFL, flags);
+        atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed);
     }
 
 _error_out:
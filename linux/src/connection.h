@@ -1,23 +1,71 @@
-/* DroidCam & DroidCamX (C) 2010-
- * https://github.com/aramg
- * 
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
- * Use at your own risk. See README file for more details.
- */
-#ifndef __CONN_H__
-#define __CONN_H__
-
-#define INVALID_SOCKET -1
-typedef int SOCKET;
-
-SOCKET connect_droidcam(char * ip, int port);
-void connection_cleanup();
-void disconnect(SOCKET s);
-
-SOCKET accept_connection(int port);
-
-int SendRecv(int doSend, char * buffer, int bytes, SOCKET s);
-
-#endif
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <stdatomic.h>
+
+#define INVALID_SOCKET -1
+typedef int SOCKET;
+
+/* Bounds on waiting for a phone that is not there, or has gone quiet */
+#define CONNECT_TIMEOUT_MS 5000
+#define RECV_TIMEOUT_MS 10000
+
+SOCKET connect_droidcam(char * ip, int port);
+void connection_cleanup();
+
+/* connection_stop() wakes every thread waiting to connect, accept or
+ * receive and makes it give up, until connection_start(). It only writes
+ * an eventfd, so it can be called from a signal handler. */
+void connection_start(void);
+void connection_stop(void);
+int  connection_stopped(void);
+/* The stop eventfd, to wait on it elsewhere, and the time since the stop,
+ * for how long the threads took to end */
+int  connection_stop_fd(void);
+double connection_stop_ms(void);
+
+/* Has a control command (OTHER_REQ) sent to the phone right away, even in
+ * the middle of a frame. Only taken while exactly one recv_buf stream runs,
+ * the phones of several streams can't be told apart; io_uring streams take
+ * none. FALSE if not taken or one is still pending. */
+int  connection_control(int cmd);
+void disconnect(SOCKET s);
+unsigned connection_count(void);
+
+SOCKET accept_connection(int port);
+
+int SendRecv(int doSend, char * buffer, int bytes, SOCKET s);
+
+/* Read-ahead for the video stream. Every read asks for the rest of the
+ * frame straight into its slot and for as much as fits of what follows
+ * into 'data', so the next length prefixes, and often whole frames, are
+ * already here. Sized for several 1080p frames.
+ * The socket is made non-blocking; when it runs dry the thread waits in
+ * epoll on it, the stop eventfd and its own control eventfd, which says a
+ * command is pending in 'control_cmd'. */
+#define RECV_BUF_SZ (1 << 20)
+struct recv_buf_s {
+ SOCKET s;
+ int epfd;
+ int control_fd;
+ atomic_int control_cmd;
+ struct recv_buf_s *next;  /* in the streams running */
+ unsigned char *data;
+ unsigned head, tail;   /* bytes buffered between the two */
+};
+
+int  recv_buf_init(struct recv_buf_s *r, SOCKET s);
+void recv_buf_fini(struct recv_buf_s *r);
+
+struct decoder_s;
+int recv_video_frame(struct decoder_s *d, struct recv_buf_s *r);
+
+#endif
@@ -11,25 +11,33 @@
 #undef HAVE_AV_CONFIG_H
 #endif
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/ioctl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <linux/videodev2.h>
+#include <time.h>
 #include <linux/limits.h>
 
-#include "jpeglib.h"
 #include "libswscale/swscale.h"
 // #include "speex/speex.h"
 
 #include "common.h"
+#include "bufpool.h"
 #include "decoder.h"
+#include "jpgdec.h"
+#include "output.h"
+#include "trace.h"
+#include "transform.h"
 
 struct spx_decoder_s {
  void *state;
@@ -41,103 +49,131 @@ struct spx_decoder_s {
 };
 
 struct jpg_dec_ctx_s {
- struct jpeg_decompress_struct dinfo;
- struct jpeg_error_mgr jerr;
- int init;
- int subsamp;
+ struct jpgdec_s jpg;
  int m_width, m_height;
  int m_Yuv420Size, m_ySize, m_uvSize;
- int m_webcamYuvSize, m_webcam_ySize, m_webcam_uvSize;;
- int m_NextFrame, m_NextSlot, m_BufferLimit, m_BufferedFrames;
+ int m_decodeWidth, m_decodeHeight, m_decode_ySize, m_decode_uvSize;
 
  BYTE *m_inBuf;         /* incoming stream */
  BYTE *m_decodeBuf;     /* decoded individual frames */
- BYTE *m_webcamBuf;     /* optional, scale incoming stream for the webcam */
+ /* shared by the webcams, which are done one after the other; sized for
+  * the largest */
+ BYTE *m_webcamBuf;     /* output frame, unless the device buffers are mapped */
  BYTE *scratchBuf;
 
+ int use_remap;
+ int dct_rotate;
+};
+
+/* A device the stream goes to, at its own size and rotation. The frame is
+ * decoded once, then every webcam scales and turns it into its own output. */
+#define DECODER_MAX_WEBCAMS 4
+struct webcam_s {
+ struct output_s output;
+ int width, height;
+ int m_webcamYuvSize, m_webcam_ySize, m_webcam_uvSize;
+
  // xxx: better way to do all the scaling/rotation/etc?
  struct SwsContext *swc;
+ struct SwsContext *swc_rot;  /* scales for 90/270 degree rotation */
+ int m_rotWidth, m_rotHeight;
+ struct transform_remap_s remap;
+ struct SwsContext *swc_dct;  /* scales frames rotated before the decode */
  float scale_matrix[9];
  float angle_matrix[9];
-
- /* these should be alloced for each frame but sunce the stream
-  * from the app will be consistent, we'll optimize by only allocing
-  * once */
- int cw[MAX_COMPONENTS], ch[MAX_COMPONENTS], iw[MAX_COMPONENTS], th[MAX_COMPONENTS];
- JSAMPROW *outbuf[MAX_COMPONENTS];
+ float angle_matrix_uv[9];    /* angle_matrix for the half size chroma planes */
 
  int transform;
 };
 
 #define JPG_BACKBUF_MAX 10
-struct jpg_frame_s    jpg_frames[JPG_BACKBUF_MAX];
-struct jpg_dec_ctx_s  jpg_decoder;
-struct spx_decoder_s  spx_decoder;
-
-#define WEBCAM_Wf ((float)WEBCAM_W)
-#define WEBCAM_Hf ((float)WEBCAM_H)
-static int WEBCAM_W, WEBCAM_H;
-static int droidcam_device_fd;
-
-#undef MAX_COMPONENTS
-#define MAX_COMPONENTS  4
-#define TJ_NUMSAMP 5
-#define NUMSUBOPT TJ_NUMSAMP
-
-/**
- * MCU block width (in pixels) for a given level of chrominance subsampling.
- * MCU block sizes:
- * - 8x8 for no subsampling or grayscale
- * - 16x8 for 4:2:2
- * - 8x16 for 4:4:0
- * - 16x16 for 4:2:0
- */
-static const int tjMCUWidth[TJ_NUMSAMP]  = {8, 16, 16, 8, 8};
-
-/**
- * MCU block height (in pixels) for a given level of chrominance subsampling.
- * MCU block sizes:
- * - 8x8 for no subsampling or grayscale
- * - 16x8 for 4:2:2
- * - 8x16 for 4:4:0
- * - 16x16 for 4:2:0
- */
-static const int tjMCUHeight[TJ_NUMSAMP] = {8, 8, 16, 8, 16};
-
-static const int pixelsize[TJ_NUMSAMP]={3, 3, 3, 1, 3};
-
-#define PAD(v, p) ((v+(p)-1)&(~((p)-1)))
 
-enum TJSAMP {
-  TJSAMP_444=0,
-  TJSAMP_422,
-  TJSAMP_420,
-  TJSAMP_GRAY,
-  TJSAMP_440,
-  TJSAMP_UNK,
-  TJSAMP_NIL
+/* Single-producer/single-consumer ring between the network thread, which
+ * fills frames, and the decode thread. 'head' is only written by the
+ * producer and 'tail' only by the consumer; the slot at 'tail' stays owned
+ * by the consumer until its decode is done. The extra slot past the end is
+ * where the producer receives frames it has to drop because the ring is full.
+ *
+ * With streaming decode a frame is queued as soon as its length is known,
+ * and the consumer follows its 'received' count while it arrives. The
+ * consumer only sleeps on 'ready' after raising 'waiting', so the producer
+ * skips the sem_post() for every chunk nobody is waiting on. The other way
+ * round, decoder_drain(d) sleeps on 'drained' after raising 'drain_waiting'
+ * until the consumer has caught up. */
+/* Playout delay for the jitter buffer, estimated by the network thread
+ * from frame arrival times. The delay is a few times the smoothed
+ * deviation of the inter-arrival time from its average. It grows as soon
+ * as the jitter does and shrinks slowly once the link settles. */
+#define JITTER_MAX_MS_DEFAULT 200
+struct jitter_s {
+ uint64_t last_arrival;
+ int64_t interval;      /* average time between frames, usecs */
+ int64_t jitter;        /* average deviation from it */
+ unsigned min_us, max_us;
+ atomic_uint delay_us;  /* read by the decode thread */
 };
 
+/* Latency budget: a frame that would reach the device more than budget_us
+ * after it arrived is dropped before decoding, unless it is the newest
+ * one. proc_us is the smoothed time from decode start to output. */
+#define LATENCY_BUDGET_MS_DEFAULT 250
+struct latency_s {
+ unsigned budget_us;
+ unsigned proc_us;
+};
 
-static int fatal_error = 0;
-
-void jpeg_mem_dest_tj(j_compress_ptr, unsigned char **, unsigned long *, boolean);
-void jpeg_mem_src_tj(j_decompress_ptr, unsigned char *, unsigned long);
+/* Counters for decoder_get_stats(d), each only ever added to by one
+ * thread. The stamps of the last frame out are written by the decode
+ * thread between two increments of 'seq', so a reader that sees the same
+ * even 'seq' before and after has a whole set. */
+struct stats_s {
+ atomic_uint frames_in;
+ atomic_uint frames_out;
+ atomic_uint dropped;
+ atomic_ullong bytes_in;
+ atomic_uint size_hist[STATS_BUCKETS];
+ atomic_uint stage_hist[STATS_STAGES][STATS_BUCKETS];
+ atomic_ullong stage_sum[STATS_STAGES];
+ atomic_uint seq;
+ _Atomic uint64_t last[FRAME_STAMPS];
+};
 
-static void decoder_share_frame();
-static void decoder_set_stransform(int value);
+struct jpg_ring_s {
+ struct jpg_frame_s frames[JPG_BACKBUF_MAX + 1];
+ atomic_uint head;
+ atomic_uint tail;
+ atomic_uint events;
+ atomic_int waiting;
+ atomic_int drain_waiting;
+ int dropping;
+ int queued;
+ int streaming;
+ sem_t ready;
+ sem_t drained;
+ atomic_int running;
+ pthread_t thread;
+ int started;
+};
 
-void joutput_message(j_common_ptr cinfo) {
-    char buffer[JMSG_LENGTH_MAX];
-    (*cinfo->err->format_message) (cinfo, buffer);
-    dbgprint("JERR: %s", buffer);
-}
+/* One phone stream, from the frames coming in to the output. Nothing is
+ * shared between two of them, so each can run on threads of its own. */
+struct decoder_s {
+ struct webcam_s       webcams[DECODER_MAX_WEBCAMS];
+ int                   webcam_count;
+ struct jpg_ring_s     jpg_ring;
+ struct jitter_s       jitter;
+ struct latency_s      latency;
+ struct stats_s        stats;
+ struct jpg_dec_ctx_s  jpg_decoder;
+ struct spx_decoder_s  spx_decoder;
+ int webcam_w, webcam_h;      /* the largest webcam, asked of the phone */
+ struct jpg_frame_s *decoding;  /* for wait_frame_bytes() */
+};
 
-void jerror_exit(j_common_ptr cinfo) {
-    dbgprint("jerror_exit(), fatal error");
-    fatal_error = 1;
-    (*cinfo->err->output_message) (cinfo);
-}
+static void decoder_share_frame(struct decoder_s *d, struct webcam_s *w, BYTE *decoded, BYTE *out, int transform, uint64_t *ts);
+static void decoder_set_stransform(struct webcam_s *w, int value);
+static int  decoder_start_thread(struct decoder_s *d);
+static void decoder_stop_thread(struct decoder_s *d);
 
 static inline void fill_matrix(float sx, float sy, float angle, float scale, float *matrix) {
     matrix[0] = scale * cos(angle);
@@ -153,322 +189,518 @@ static inline void fill_matrix(float sx, float sy, float angle, float scale, flo
 
 #define FREE_OBJECT(obj, free_func) if(obj){dbgprint(" " #obj " %p\n", obj); free_func(obj); obj=NULL;}
 
-static int xioctl(int fd, int request, void *arg){
-    int r;
-    do r = ioctl (fd, request, arg);
-    while (-1 == r && EINTR == errno);
-    return r;
-}
-
 static inline int clip(int v){ return ((v < 0) ? 0 : ((v >= 256) ? 255 : v)); }
 
-static int find_droidcam_v4l(){
-    int crt_video_dev = 0;
-    char device[12];
-    struct stat st;
-    struct v4l2_capability v4l2cap;
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    for(crt_video_dev = 0; crt_video_dev < 99; crt_video_dev++) {
-        droidcam_device_fd = -1;
-        sprintf(device, "/dev/video%d", crt_video_dev);
-        if(-1 == stat(device, &st)){
-            continue;
-        }
+/* The buffer the last pipeline stage should produce the frame in */
+static BYTE *decoder_output_buffer(struct decoder_s *d, struct webcam_s *w) {
+    BYTE *p = output_buffer(&w->output);
+    return (p != NULL) ? p : d->jpg_decoder.m_webcamBuf;
+}
 
-        if(!S_ISCHR(st.st_mode)){
-            continue;
-        }
+/* Hands the finished frame to the output. 'ts' are the stamps of the
+ * frame it came from, or NULL; the frame goes out with the time it
+ * started to arrive. */
+static void decoder_output_frame(struct webcam_s *w, BYTE *p, uint64_t *ts) {
+    uint64_t t;
+    if (ts != NULL)
+        ts[FRAME_TRANSFORM_END] = now_us();
 
-        droidcam_device_fd = open(device, O_RDWR | O_NONBLOCK, 0);
+    t = trace_begin();
+    output_frame(&w->output, p, (ts != NULL) ? ts[FRAME_FIRST_BYTE] : 0);
+    trace_end("write", t);
 
-        if(-1 == droidcam_device_fd) {
-            printf("Error opening '%s': %d '%s'\n", device, errno, strerror(errno));
-            continue;
-        }
-        if(-1 == xioctl(droidcam_device_fd, VIDIOC_QUERYCAP, &v4l2cap)) {
-            close(droidcam_device_fd);
-            continue;
-        }
-        printf("Device: %s\n", v4l2cap.card);
-        if(0 == strncmp((const char*) v4l2cap.card, "Droidcam", 8)) {
-            printf("Found driver: %s (fd:%d)\n", device, droidcam_device_fd);
-            return 1;
-        }
-        close(droidcam_device_fd); // not DroidCam .. keep going
-        continue;
-    }
-    MSG_ERROR("Device not found (/dev/video[0-9]).\nDid you install it?\n");
-    return 0;
+    if (ts != NULL)
+        ts[FRAME_SUBMIT] = now_us();
 }
 
-static void query_droidcam_v4l(void) {
-    struct v4l2_format vid_format = {0};
-    vid_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vid_format.fmt.pix.width = 0;
-    vid_format.fmt.pix.height = 0;
-    if (xioctl(droidcam_device_fd, VIDIOC_G_FMT, &vid_format) < 0) {
-        fprintf(stderr, "Fatal: Unable to query droidcam video device. errno=%d\n", errno);
-        return;
-    }
+/* Minimum playout delay; the jitter buffer adds to it as needed, up to
+ * DROIDCAM_MAX_DELAY_MS (200 by default) */
+void decoder_set_video_delay(struct decoder_s *d, unsigned ms) {
+    const char *env = getenv("DROIDCAM_MAX_DELAY_MS");
+    unsigned max = (env != NULL) ? (unsigned)atoi(env) : JITTER_MAX_MS_DEFAULT;
+
+    if (ms > max) ms = max;
+    d->jitter.min_us = ms * 1000;
+    d->jitter.max_us = max * 1000;
+    atomic_store(&d->jitter.delay_us, d->jitter.min_us);
+    dbgprint("video delay %u-%u ms\n", ms, max);
+}
 
-    dbgprint("  vid_format->type                =%d\n", vid_format.type );
-    dbgprint("  vid_format->fmt.pix.width       =%d\n", vid_format.fmt.pix.width );
-    dbgprint("  vid_format->fmt.pix.height      =%d\n", vid_format.fmt.pix.height );
-    dbgprint("  vid_format->fmt.pix.pixelformat =%d\n", vid_format.fmt.pix.pixelformat);
-    dbgprint("  vid_format->fmt.pix.sizeimage   =%d\n", vid_format.fmt.pix.sizeimage );
-    dbgprint("  vid_format->fmt.pix.field       =%d\n", vid_format.fmt.pix.field );
-    dbgprint("  vid_format->fmt.pix.bytesperline=%d\n", vid_format.fmt.pix.bytesperline );
-    dbgprint("  vid_format->fmt.pix.colorspace  =%d\n", vid_format.fmt.pix.colorspace );
-    if (vid_format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420) {
-        fprintf(stderr, "Fatal: droidcam video device reported pixel format %d, expected %d\n",
-            vid_format.fmt.pix.pixelformat, V4L2_PIX_FMT_YUV420);
+/* Network thread: a frame header came in at 't' */
+static void jitter_update(struct decoder_s *d, uint64_t t) {
+    int64_t dt, dev, target, delay, cap;
+
+    if (d->jitter.last_arrival == 0 || t <= d->jitter.last_arrival) {
+        d->jitter.last_arrival = t;
         return;
     }
-    if (vid_format.fmt.pix.width <= 0 ||  vid_format.fmt.pix.height <= 0) {
-        fprintf(stderr, "Fatal: droidcam video device reported invalid resolution: %dx%d\n",
-            vid_format.fmt.pix.width, vid_format.fmt.pix.height);
-        return;
+    dt = (int64_t)(t - d->jitter.last_arrival);
+    d->jitter.last_arrival = t;
+
+    if (d->jitter.interval == 0)
+        d->jitter.interval = dt;
+    dev = llabs(dt - d->jitter.interval);
+    if (dev > d->jitter.max_us)
+        dev = d->jitter.max_us;
+    d->jitter.interval += (dt - d->jitter.interval) / 16;
+    d->jitter.jitter += (dev - d->jitter.jitter) / 16;
+
+    // ~3 deviations cover nearly all late frames; never more than the
+    // ring holds at the current frame rate, or than the latency budget
+    // leaves room for
+    target = 3 * d->jitter.jitter;
+    cap = (JPG_BACKBUF_MAX - 2) * d->jitter.interval;
+    if (target > cap) target = cap;
+    if (d->latency.budget_us > 0 && target > (int64_t)d->latency.budget_us / 2) target = d->latency.budget_us / 2;
+    if (target > d->jitter.max_us) target = d->jitter.max_us;
+    if (target < d->jitter.min_us) target = d->jitter.min_us;
+
+    delay = atomic_load_explicit(&d->jitter.delay_us, memory_order_relaxed);
+    if (target > delay) {
+        delay = target;
+    } else {
+        delay -= (delay - target + 63) / 64;
     }
+    atomic_store_explicit(&d->jitter.delay_us, (unsigned)delay, memory_order_relaxed);
+}
+
+/* Everything but the output, once the webcam size is known */
+static int decoder_init_common(struct decoder_s *d) {
+    const char *backend = getenv("DROIDCAM_JPEG_BACKEND");
+    const char *env;
+
+    memset(&d->jpg_decoder, 0, sizeof(struct jpg_dec_ctx_s));
+    if (!jpgdec_init(&d->jpg_decoder.jpg, jpgdec_backend_from_name(backend)))
+        return 0;
+    decoder_set_video_delay(d, 0);
+    env = getenv("DROIDCAM_LATENCY_MS");
+    d->latency.budget_us = ((env != NULL) ? (unsigned)atoi(env) : LATENCY_BUDGET_MS_DEFAULT) * 1000;
 
-    WEBCAM_W = vid_format.fmt.pix.width;
-    WEBCAM_H = vid_format.fmt.pix.height;
+#if 0
+    speex_bits_init(&d->spx_decoder.bits);
+    d->spx_decoder.state = speex_decoder_init(speex_lib_get_mode(SPEEX_MODEID_WB));
+    speex_decoder_ctl(d->spx_decoder.state, SPEEX_GET_FRAME_SIZE, &d->spx_decoder.frame_size);
+    dbgprint("spx_decoder.state=%p\n", d->spx_decoder.state);
+#endif
+
+    return 1;
 }
 
-void decoder_set_video_delay(unsigned v) {
-    if (v > JPG_BACKBUF_MAX) v = JPG_BACKBUF_MAX;
-    else if (v < 1) v = 1;
-    jpg_decoder.m_BufferLimit = v;
-    dbgprint("buffer %d frames\n", jpg_decoder.m_BufferLimit);
+/* The output is picked with DROIDCAM_OUTPUT, see decoder_init_sink();
+ * sinks other than the loopback device take their size from DROIDCAM_SIZE.
+ * Returns NULL if it cannot be opened. */
+struct decoder_s *decoder_init(void) {
+    return decoder_init_sink(getenv("DROIDCAM_OUTPUT"));
 }
 
-int decoder_init(void) {
-    WEBCAM_W = 0;
-    WEBCAM_H = 0;
+/* Opens one more output for the stream */
+static int decoder_add_webcam(struct decoder_s *d, int sink, const char *arg, int width, int height, int transform) {
+    struct webcam_s *w = &d->webcams[d->webcam_count];
 
-    if (!find_droidcam_v4l())
+    if (d->webcam_count == DECODER_MAX_WEBCAMS) {
+        errprint("at most %d outputs per stream\n", DECODER_MAX_WEBCAMS);
         return 0;
-    query_droidcam_v4l();
-    dbgprint("WEBCAM_W=%d, WEBCAM_H=%d\n", WEBCAM_W, WEBCAM_H);
-    if (WEBCAM_W < 2 || WEBCAM_H < 2 || WEBCAM_W > 9999 || WEBCAM_H > 9999){
-        MSG_ERROR("Unable to query droidcam device for parameters");
+    }
+    if (!output_open(&w->output, sink, arg, width, height))
         return 0;
+    w->width  = w->output.width;
+    w->height = w->output.height;
+    w->m_webcamYuvSize  = w->width * w->height * 3 / 2;
+    w->m_webcam_ySize   = w->width * w->height;
+    w->m_webcam_uvSize  = w->m_webcam_ySize / 4;
+    w->transform = transform;
+    if (w->width > d->webcam_w) d->webcam_w = w->width;
+    if (w->height > d->webcam_h) d->webcam_h = w->height;
+    dbgprint("webcam %d: %dx%d\n", d->webcam_count, w->width, w->height);
+    d->webcam_count++;
+    return 1;
+}
+
+static void decoder_free(struct decoder_s *d) {
+    int i;
+    for (i = 0; i < d->webcam_count; i++)
+        output_close(&d->webcams[i].output);
+    free(d);
+}
+
+/* As decoder_init(), into 'output': one or more of the names taken by
+ * output_sink_from_name(), separated by commas, each optionally followed
+ * by @WxH for its size and @90, @180 or @270 for its rotation, e.g.
+ * "/dev/video2,/dev/video3@90" or "null@1280x720,file:/tmp/a.yuv@320x240".
+ * The stream is decoded once for all of them. */
+struct decoder_s *decoder_init_sink(const char *output) {
+    struct decoder_s *d;
+    const char *arg, *env = getenv("DROIDCAM_SIZE");
+    char spec[512], *item, *opt, *next;
+    int width = 640, height = 480;
+
+    if (env != NULL && sscanf(env, "%dx%d", &width, &height) != 2) {
+        errprint("DROIDCAM_SIZE should be WxH\n");
+        return NULL;
+    }
+    if ((d = (struct decoder_s*)calloc(1, sizeof(struct decoder_s))) == NULL)
+        return NULL;
+
+    snprintf(spec, sizeof(spec), "%s", (output != NULL) ? output : "v4l2");
+    for (item = spec; item != NULL; item = next) {
+        int sink, w = width, h = height, degrees = 0;
+
+        if ((next = strchr(item, ',')) != NULL)
+            *next++ = 0;
+        if ((opt = strchr(item, '@')) != NULL)
+            *opt++ = 0;
+        while (opt != NULL) {
+            char *o = opt, *end;
+            int n = 0, ok;
+            if ((opt = strchr(o, '@')) != NULL)
+                *opt++ = 0;
+            if (strchr(o, 'x') != NULL) {
+                ok = sscanf(o, "%dx%d%n", &w, &h, &n) == 2 && o[n] == 0 && w > 0 && h > 0;
+            } else {
+                degrees = (int)strtol(o, &end, 10);
+                ok = isdigit((unsigned char)*o) && *end == 0
+                    && (degrees == 0 || degrees == 90 || degrees == 180 || degrees == 270);
+            }
+            if (!ok) {
+                errprint("bad output option '%s'\n", o);
+                goto _error_out;
+            }
+        }
+        sink = output_sink_from_name(item, &arg);
+        if (!decoder_add_webcam(d, sink, arg, w, h, degrees / 90))
+            goto _error_out;
     }
+    if (!decoder_init_common(d))
+        goto _error_out;
+    return d;
 
-    fatal_error = 0;
-    memset(&jpg_decoder, 0, sizeof(struct jpg_dec_ctx_s));
-    jpg_decoder.dinfo.err = jpeg_std_error(&jpg_decoder.jerr);
-    jpg_decoder.jerr.output_message = joutput_message;
-    jpg_decoder.jerr.error_exit = jerror_exit;
-    jpeg_create_decompress(&jpg_decoder.dinfo);
-    if (fatal_error) return 0;
-    jpg_decoder.init = 1;
-    jpg_decoder.subsamp = TJSAMP_NIL;
-    jpg_decoder.m_webcamYuvSize  = WEBCAM_W * WEBCAM_H * 3 / 2;
-    jpg_decoder.m_webcam_ySize   = WEBCAM_W * WEBCAM_H;
-    jpg_decoder.m_webcam_uvSize  = jpg_decoder.m_webcam_ySize / 4;
-    jpg_decoder.transform = 0;
-    decoder_set_video_delay(0);
+_error_out:
+    decoder_free(d);
+    return NULL;
+}
 
-#if 0
-    speex_bits_init(&spx_decoder.bits);
-    spx_decoder.state = speex_decoder_init(speex_lib_get_mode(SPEEX_MODEID_WB));
-    speex_decoder_ctl(spx_decoder.state, SPEEX_GET_FRAME_SIZE, &spx_decoder.frame_size);
-    dbgprint("spx_decoder.state=%p\n", spx_decoder.state);
-#endif
+/* A decoder for one stream into the given output */
+struct decoder_s *decoder_init_output(int sink, const char *arg, int width, int height) {
+    struct decoder_s *d = (struct decoder_s*)calloc(1, sizeof(struct decoder_s));
 
-    return 1;
+    if (d == NULL)
+        return NULL;
+    if (!decoder_add_webcam(d, sink, arg, width, height, 0) || !decoder_init_common(d)) {
+        decoder_free(d);
+        return NULL;
+    }
+    return d;
+}
+
+/* For droidcam-bench: a width x height webcam whose frames go to /dev/null */
+struct decoder_s *decoder_init_bench(int width, int height) {
+    return decoder_init_output(OUTPUT_FILE, "/dev/null", width, height);
 }
 
-void decoder_fini() {
-    if (droidcam_device_fd) close(droidcam_device_fd);
-    dbgprint("spx_decoder.state=%p\n", spx_decoder.state);
-    if (spx_decoder.state != NULL) {
+void decoder_fini(struct decoder_s *d) {
+    dbgprint("spx_decoder.state=%p\n", d->spx_decoder.state);
+    if (d->spx_decoder.state != NULL) {
 #if 0
-        speex_bits_destroy(&spx_decoder.bits);
-        speex_decoder_destroy(spx_decoder.state);
+        speex_bits_destroy(&d->spx_decoder.bits);
+        speex_decoder_destroy(d->spx_decoder.state);
 #endif
-        spx_decoder.state = NULL;
-    }
-    fatal_error = 0;
-    if (jpg_decoder.init != 0) {
-        jpeg_destroy_decompress(&jpg_decoder.dinfo);
-        jpg_decoder.init = 0;
+        d->spx_decoder.state = NULL;
     }
+    jpgdec_fini(&d->jpg_decoder.jpg);
+    decoder_free(d);
 }
 
-int decoder_prepare_video(char * header) {
-    int i;
-    make_int(jpg_decoder.m_width,  header[0], header[1]);
-    make_int(jpg_decoder.m_height, header[2], header[3]);
+int decoder_prepare_video(struct decoder_s *d, char * header) {
+    int i, webcamYuvSize = 0;
+    struct webcam_s *w;
+    const char *env;
+    make_int(d->jpg_decoder.m_width,  header[0], header[1]);
+    make_int(d->jpg_decoder.m_height, header[2], header[3]);
 
-    if (jpg_decoder.m_width <= 0 || jpg_decoder.m_height <= 0) {
+    // the sizes below are ints, and the slots hold JPG_BACKBUF_MAX+1 frames
+    if (d->jpg_decoder.m_width <= 0 || d->jpg_decoder.m_height <= 0
+        || (long long)d->jpg_decoder.m_width * d->jpg_decoder.m_height * 3 / 2 * (JPG_BACKBUF_MAX + 1) + 4096 > INT_MAX) {
         MSG_ERROR("Invalid data stream!");
         return FALSE;
     }
 
-    dbgprint("Stream W=%d H=%d\n", jpg_decoder.m_width, jpg_decoder.m_height);
+    dbgprint("Stream W=%d H=%d\n", d->jpg_decoder.m_width, d->jpg_decoder.m_height);
 
-    jpg_decoder.m_ySize       = jpg_decoder.m_width * jpg_decoder.m_height;
-    jpg_decoder.m_uvSize      = jpg_decoder.m_ySize / 4;
-    jpg_decoder.m_Yuv420Size  = jpg_decoder.m_ySize * 3 / 2;
-    jpg_decoder.m_inBuf       = (BYTE*)malloc((jpg_decoder.m_Yuv420Size * JPG_BACKBUF_MAX + 4096) * sizeof(BYTE));
-    jpg_decoder.m_decodeBuf   = (BYTE*)malloc(jpg_decoder.m_Yuv420Size * sizeof(BYTE));
-    jpg_decoder.scratchBuf    = (BYTE*)malloc(jpg_decoder.m_webcam_ySize * 2 * sizeof(BYTE));
-
-    if (jpg_decoder.m_webcamYuvSize != jpg_decoder.m_Yuv420Size) {
-        jpg_decoder.m_webcamBuf = (BYTE*)malloc(jpg_decoder.m_webcamYuvSize * sizeof(BYTE));
-        jpg_decoder.swc = sws_getCachedContext(NULL,
-                jpg_decoder.m_width, jpg_decoder.m_height, AV_PIX_FMT_YUV420P, /* src */
-                WEBCAM_W, WEBCAM_H , AV_PIX_FMT_YUV420P, /* dst */
-                SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
+    d->jpg_decoder.m_ySize       = d->jpg_decoder.m_width * d->jpg_decoder.m_height;
+    d->jpg_decoder.m_uvSize      = d->jpg_decoder.m_ySize / 4;
+    d->jpg_decoder.m_Yuv420Size  = d->jpg_decoder.m_ySize * 3 / 2;
+    for (i = 0; i < d->webcam_count; i++) {
+        if (d->webcams[i].m_webcamYuvSize > webcamYuvSize)
+            webcamYuvSize = d->webcams[i].m_webcamYuvSize;
+    }
+    d->jpg_decoder.m_inBuf       = bufpool_get((d->jpg_decoder.m_Yuv420Size * (JPG_BACKBUF_MAX + 1) + 4096) * sizeof(BYTE));
+    d->jpg_decoder.m_decodeBuf   = bufpool_get(d->jpg_decoder.m_Yuv420Size * sizeof(BYTE));
+    d->jpg_decoder.scratchBuf    = bufpool_get(webcamYuvSize * sizeof(BYTE));
+    d->jpg_decoder.m_webcamBuf   = bufpool_get(webcamYuvSize * sizeof(BYTE));
+    if (d->jpg_decoder.m_inBuf == NULL || d->jpg_decoder.m_decodeBuf == NULL
+        || d->jpg_decoder.scratchBuf == NULL || d->jpg_decoder.m_webcamBuf == NULL) {
+        errprint("no memory for %dx%d frames\n", d->jpg_decoder.m_width, d->jpg_decoder.m_height);
+        goto _error_out;
     }
 
-    dbgprint("jpg: webcambuf: %p\n", jpg_decoder.m_webcamBuf);
-    dbgprint("jpg: decodebuf: %p\n", jpg_decoder.m_decodeBuf);
-    dbgprint("jpg: inbuf    : %p\n", jpg_decoder.m_inBuf);
-
-    for (i = 0; i < JPG_BACKBUF_MAX; i++) {
-        jpg_frames[i].data = &jpg_decoder.m_inBuf[i*jpg_decoder.m_Yuv420Size];
-        jpg_frames[i].length = 0;
-        dbgprint("jpg: jpg_frames[%d]: %p\n", i, jpg_frames[i].data);
+    // Let the IDCT do as much of the downscaling as it can (1/2, 1/4, 1/8),
+    // the scaler only covers what is left. With several webcams the
+    // largest decides.
+    for (i = 8; i > 1; i /= 2) {
+        if (d->webcam_w <= d->jpg_decoder.m_width / i && d->webcam_h <= d->jpg_decoder.m_height / i
+            && d->jpg_decoder.m_width % (i * 2) == 0 && d->jpg_decoder.m_height % (i * 2) == 0)
+            break;
+    }
+    jpgdec_set_scale(&d->jpg_decoder.jpg, i);
+    d->jpg_decoder.m_decodeWidth    = d->jpg_decoder.m_width / i;
+    d->jpg_decoder.m_decodeHeight   = d->jpg_decoder.m_height / i;
+    d->jpg_decoder.m_decode_ySize   = d->jpg_decoder.m_decodeWidth * d->jpg_decoder.m_decodeHeight;
+    d->jpg_decoder.m_decode_uvSize  = d->jpg_decoder.m_decode_ySize / 4;
+    dbgprint("Decode 1/%d: W=%d H=%d\n", i, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight);
+
+    // Rotations that also scale go through the remap tables in one pass.
+    // Without them (DROIDCAM_REMAP=0), 90/270 degrees scale the frame into
+    // scratchBuf to fit the webcam height once it is on its side and then
+    // rotate it into the middle of the output. Portrait webcam sizes then
+    // fall back to apply_transform(w). Rotating the DCT blocks changes the
+    // decode itself, so it is only done for a single webcam.
+    env = getenv("DROIDCAM_DCT_ROTATE");
+    d->jpg_decoder.dct_rotate = (env != NULL && atoi(env) != 0 && d->webcam_count == 1);
+    env = getenv("DROIDCAM_REMAP");
+    d->jpg_decoder.use_remap = (env == NULL || atoi(env) != 0);
+
+    for (i = 0; i < d->webcam_count; i++) {
+        w = &d->webcams[i];
+        if (d->jpg_decoder.m_decodeWidth != w->width || d->jpg_decoder.m_decodeHeight != w->height) {
+            w->swc = sws_getCachedContext(w->swc,
+                    d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight, AV_PIX_FMT_YUV420P, /* src */
+                    w->width, w->height , AV_PIX_FMT_YUV420P, /* dst */
+                    SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
+        }
+        w->m_rotWidth  = w->height;
+        w->m_rotHeight = (w->height * w->height / w->width) & ~1;
+        if (!d->jpg_decoder.use_remap && w->m_rotHeight >= 2 && w->m_rotHeight <= w->width) {
+            w->swc_rot = sws_getCachedContext(w->swc_rot,
+                    d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight, AV_PIX_FMT_YUV420P, /* src */
+                    w->m_rotWidth, w->m_rotHeight, AV_PIX_FMT_YUV420P, /* dst */
+                    SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
+        }
+        decoder_set_stransform(w, w->transform);
     }
 
-    jpg_decoder.m_BufferedFrames  = jpg_decoder.m_NextFrame = jpg_decoder.m_NextSlot = 0;
-    decoder_set_stransform(jpg_decoder.transform);
+    dbgprint("jpg: webcambuf: %p\n", d->jpg_decoder.m_webcamBuf);
+    dbgprint("jpg: decodebuf: %p\n", d->jpg_decoder.m_decodeBuf);
+    dbgprint("jpg: inbuf    : %p\n", d->jpg_decoder.m_inBuf);
 
-    for(i=0; i<MAX_COMPONENTS; i++){
-        jpg_decoder.outbuf[i]=NULL;
+    for (i = 0; i < JPG_BACKBUF_MAX + 1; i++) {
+        d->jpg_ring.frames[i].data = &d->jpg_decoder.m_inBuf[i*d->jpg_decoder.m_Yuv420Size];
+        d->jpg_ring.frames[i].length = 0;
+        dbgprint("jpg: jpg_frames[%d]: %p\n", i, d->jpg_ring.frames[i].data);
     }
 
-    return TRUE;
+    return decoder_start_thread(d);
+
+_error_out:
+    FREE_OBJECT(d->jpg_decoder.m_inBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.m_decodeBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.m_webcamBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.scratchBuf, bufpool_put);
+    return FALSE;
 }
 
-void decoder_cleanup() {
+void decoder_cleanup(struct decoder_s *d) {
     int i;
     dbgprint("Cleanup\n");
-    for(i=0; i<MAX_COMPONENTS; i++){
-        FREE_OBJECT(jpg_decoder.outbuf[i], free);
-    }
-
-    FREE_OBJECT(jpg_decoder.m_inBuf, free);
-    FREE_OBJECT(jpg_decoder.m_decodeBuf, free);
-    FREE_OBJECT(jpg_decoder.m_webcamBuf, free);
-    FREE_OBJECT(jpg_decoder.scratchBuf, free);
-    FREE_OBJECT(jpg_decoder.swc, sws_freeContext);
-}
-
-static void decode_next_frame() {
-    struct jpeg_decompress_struct *dinfo = &jpg_decoder.dinfo;
-    BYTE *p = jpg_frames[jpg_decoder.m_NextFrame].data;
-    unsigned long len = (unsigned long)jpg_frames[jpg_decoder.m_NextFrame].length;
-
-    int i,k, row, usetmpbuf=0;
-    JSAMPLE *ptr=jpg_decoder.m_decodeBuf;
-
-    jpeg_mem_src(dinfo, p, len);
-    jpeg_read_header(dinfo, TRUE);
-    if (fatal_error) return;
-    dinfo->raw_data_out=TRUE;
-    dinfo->do_fancy_upsampling=FALSE;
-    dinfo->dct_method=JDCT_FASTEST;
-    dinfo->out_color_space=JCS_YCbCr;
-
-    if (jpg_decoder.subsamp == TJSAMP_NIL) {
-        int retval=TJSAMP_NIL;
-        for(i=0; i<NUMSUBOPT; i++) {
-            if(dinfo->num_components==pixelsize[i]){
-                if(dinfo->comp_info[0].h_samp_factor==tjMCUWidth[i]/8
-                    && dinfo->comp_info[0].v_samp_factor==tjMCUHeight[i]/8) {
-                    int match=0;
-                    for(k=1; k<dinfo->num_components; k++) {
-                        if(dinfo->comp_info[k].h_samp_factor==1
-                            && dinfo->comp_info[k].v_samp_factor==1)
-                            match++;
-                    }
-                    if(match==dinfo->num_components-1) {
-                        retval=i;  break;
-                    }
-                }
-            }
-        }
-        dbgprint("subsampling=%d\n", retval);
-        if (retval >= 0 && retval < TJSAMP_NIL) {
-            jpg_decoder.subsamp = retval;
-        } else {
-            jpg_decoder.subsamp = TJSAMP_UNK;
-        }
+    decoder_stop_thread(d);
+    jpgdec_reset(&d->jpg_decoder.jpg);
+
+    FREE_OBJECT(d->jpg_decoder.m_inBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.m_decodeBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.m_webcamBuf, bufpool_put);
+    FREE_OBJECT(d->jpg_decoder.scratchBuf, bufpool_put);
+    for (i = 0; i < d->webcam_count; i++) {
+        struct webcam_s *w = &d->webcams[i];
+        FREE_OBJECT(w->swc, sws_freeContext);
+        FREE_OBJECT(w->swc_rot, sws_freeContext);
+        FREE_OBJECT(w->swc_dct, sws_freeContext);
+        transform_remap_fini(&w->remap);
     }
+}
 
-    if (jpg_decoder.subsamp != TJSAMP_420) {
-        fprintf(stderr, "Error: Unexpected video image stream subsampling\n");
-        jpeg_abort_decompress(dinfo);
-        return;
-    }
+static void ring_signal(struct decoder_s *d) {
+    atomic_fetch_add(&d->jpg_ring.events, 1);
+    if (atomic_exchange(&d->jpg_ring.waiting, 0))
+        sem_post(&d->jpg_ring.ready);
+}
 
-    if (jpg_decoder.outbuf[i] == NULL) {
-        int ih;
-        int *cw = jpg_decoder.cw;
-        int *ch = jpg_decoder.ch;
-        int *iw = jpg_decoder.iw;
-        int *th = jpg_decoder.th;
-        JSAMPROW **outbuf = jpg_decoder.outbuf;
-        for(i=0; i<dinfo->num_components; i++) {
-            jpeg_component_info *compptr=&dinfo->comp_info[i];
-            iw[i]=compptr->width_in_blocks*DCTSIZE;
-            ih=compptr->height_in_blocks*DCTSIZE;
-            cw[i]=PAD(dinfo->image_width, dinfo->max_h_samp_factor)*compptr->h_samp_factor/dinfo->max_h_samp_factor;
-            ch[i]=PAD(dinfo->image_height, dinfo->max_v_samp_factor)*compptr->v_samp_factor/dinfo->max_v_samp_factor;
-            if(iw[i]!=cw[i] || ih!=ch[i]) {
-                usetmpbuf=1;
-                fprintf(stderr, "error: need a temp buffer, this shouldnt happen!\n");
-                jpg_decoder.subsamp = TJSAMP_UNK;
-            }
-            th[i]=compptr->v_samp_factor*DCTSIZE;
+/* Sleeps unless the producer signalled since 'events' read 'seen' */
+static void ring_wait(struct decoder_s *d, unsigned seen) {
+    atomic_store(&d->jpg_ring.waiting, 1);
+    if (atomic_load(&d->jpg_ring.events) == seen && atomic_load(&d->jpg_ring.running))
+        sem_wait(&d->jpg_ring.ready);
+    atomic_store(&d->jpg_ring.waiting, 0);
+}
 
-            dbgprint("extra alloc: %d\n", (int)(sizeof(JSAMPROW)*ch[i]));
-            if((outbuf[i]=(JSAMPROW *)malloc(sizeof(JSAMPROW)*ch[i]))==NULL) {
-                fprintf(stderr, "error: malloc failure\n");
-                jpeg_abort_decompress(dinfo);
-                return;
-            }
-            for(row=0; row<ch[i]; row++){
-                outbuf[i][row]=ptr;
-                ptr+=PAD(cw[i], 4);
-            }
+/* ring_wait(d), for at most 'us' usecs */
+static void ring_wait_timeout(struct decoder_s *d, unsigned seen, uint64_t us) {
+    struct timespec ts;
+
+    atomic_store(&d->jpg_ring.waiting, 1);
+    if (atomic_load(&d->jpg_ring.events) == seen && atomic_load(&d->jpg_ring.running)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += us / 1000000;
+        ts.tv_nsec += (us % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
         }
+        while (sem_timedwait(&d->jpg_ring.ready, &ts) < 0 && errno == EINTR)
+            ;
     }
+    atomic_store(&d->jpg_ring.waiting, 0);
+}
 
-    if(usetmpbuf) {
-        fprintf(stderr, "error: Unexpected video image dimensions\n");
-        jpeg_abort_decompress(dinfo);
-        return;
+/* jpgdec_wait_fn for the frame being decoded while it is still received */
+static unsigned long wait_frame_bytes(void *arg, unsigned long have) {
+    struct decoder_s *d = (struct decoder_s *)arg;
+    struct jpg_frame_s *f = d->decoding;
+    unsigned seen, received;
+
+    for (;;) {
+        seen = atomic_load(&d->jpg_ring.events);
+        received = atomic_load_explicit(&f->received, memory_order_acquire);
+        if (received > have || !atomic_load(&d->jpg_ring.running))
+            return received;
+        ring_wait(d, seen);
     }
+}
 
-    jpeg_start_decompress(dinfo);
-    if (fatal_error) {
-        jpeg_abort_decompress(dinfo);
-        return;
+/* Scale the src_w x src_h frame into the dst_w x dst_h one, at x, y */
+static void scale_frame(struct SwsContext *swc, BYTE *src, int src_w, int src_h,
+                        BYTE *dst, int dst_w, int dst_h, int x, int y) {
+    uint64_t t;
+    uint8_t* srcSlice[4];
+    uint8_t* dstSlice[4];
+
+    int srcStride[4] = {
+        src_w,
+        src_w>>1,
+        src_w>>1,
+    0};
+    int dstStride[4] = {
+        dst_w,
+        dst_w>>1,
+        dst_w>>1,
+    0};
+
+    srcSlice[0] = src;
+    srcSlice[1] = srcSlice[0] + src_w * src_h;
+    srcSlice[2] = srcSlice[1] + src_w * src_h / 4;
+    srcSlice[3] = NULL;
+    dstSlice[0] = dst + y * dst_w + x;
+    dstSlice[1] = dst + dst_w * dst_h + (y/2) * (dst_w/2) + x/2;
+    dstSlice[2] = dstSlice[1] + dst_w * dst_h / 4;
+    dstSlice[3] = NULL;
+
+    t = trace_begin();
+    sws_scale(swc, srcSlice, srcStride, 0, src_h, dstSlice, dstStride);
+    trace_end("sws_scale", t);
+}
+
+/* With DROIDCAM_DCT_ROTATE=1 the frame is rotated before the decode by
+ * moving its DCT coefficient blocks, losslessly, and decoded already
+ * turned; all that is left is scaling it into place. Returns 0 if that is
+ * not possible, for the pixel domain transforms to take over. */
+static int decode_rotated_frame(struct decoder_s *d, struct webcam_s *w, struct jpg_frame_s *f, BYTE *out, int transform) {
+    BYTE *jpg;
+    unsigned long len, received, now;
+    int width = d->jpg_decoder.m_width, height = d->jpg_decoder.m_height;
+    int x, y, rw, rh;
+    uint64_t t;
+
+    // the blocks can only be moved once the whole frame is in
+    received = atomic_load_explicit(&f->received, memory_order_acquire);
+    while (received < f->length) {
+        now = wait_frame_bytes(d, received);
+        if (now <= received)
+            return 1;
+        received = now;
     }
 
-    if ((int)dinfo->output_width != jpg_decoder.m_width || (int)dinfo->output_height != jpg_decoder.m_height) {
-        dbgprint("error: decoder output %dx%d differs from expected %dx%d size\n",
-            dinfo->output_width, dinfo->output_height, jpg_decoder.m_width, jpg_decoder.m_height);
-        jpeg_abort_decompress(&jpg_decoder.dinfo);
-        return;
+    // ROT90 is counter-clockwise
+    t = trace_begin();
+    if (!transform_output_rect(w->width, w->height, transform, &x, &y, &rw, &rh)
+        || !jpgdec_rotate(&d->jpg_decoder.jpg, f->data, (unsigned long)f->length,
+            (transform == TRANSFORM_ROT90) ? 270 : (transform == TRANSFORM_ROT180) ? 180 : 90, &jpg, &len))
+        return 0;
+    trace_end("dct_rotate", t);
+
+    if (transform != TRANSFORM_ROT180) {
+        width = d->jpg_decoder.m_height;
+        height = d->jpg_decoder.m_width;
     }
+    t = trace_begin();
+    if (!jpgdec_decode(&d->jpg_decoder.jpg, jpg, len, d->jpg_decoder.m_decodeBuf, width, height))
+        return 1;
+    trace_end("decode", t);
+    f->ts[FRAME_DECODE_END] = now_us();
+
+    width /= d->jpg_decoder.jpg.scale_denom;
+    height /= d->jpg_decoder.jpg.scale_denom;
+    w->swc_dct = sws_getCachedContext(w->swc_dct,
+            width, height, AV_PIX_FMT_YUV420P, /* src */
+            rw, rh, AV_PIX_FMT_YUV420P, /* dst */
+            SWS_FAST_BILINEAR /* flags */, NULL, NULL, NULL);
+    if (w->swc_dct == NULL)
+        return 0;
 
-    for(row=0; row<(int)dinfo->output_height;row+=dinfo->max_v_samp_factor*DCTSIZE){
-        JSAMPARRAY yuvptr[MAX_COMPONENTS];
-        int crow[MAX_COMPONENTS];
-        for(i=0; i<dinfo->num_components; i++){
-            jpeg_component_info *compptr=&dinfo->comp_info[i];
-            crow[i]=row*compptr->v_samp_factor/dinfo->max_v_samp_factor;
-            yuvptr[i]=&jpg_decoder.outbuf[i][crow[i]];
+    scale_frame(w->swc_dct, d->jpg_decoder.m_decodeBuf, width, height, out, w->width, w->height, x, y);
+    transform_letterbox_yuv420(out, w->width, w->height, x, y, rw, rh);
+    decoder_output_frame(w, out, f->ts);
+    return 1;
+}
+
+/* The frame is decoded once and then goes to every webcam in turn */
+static void decode_next_frame(struct decoder_s *d, struct jpg_frame_s *f) {
+    int i, ok;
+    unsigned received;
+    uint64_t t;
+    struct webcam_s *w = &d->webcams[0];
+    int transform = w->transform;
+    BYTE *out = decoder_output_buffer(d, w);
+    // for a single webcam without scaling or rotation the decoder writes
+    // the final frame itself
+    BYTE *decoded = (d->webcam_count > 1 || w->swc != NULL || transform != 0) ? d->jpg_decoder.m_decodeBuf : out;
+
+    d->decoding = f;
+    f->ts[FRAME_DECODE_START] = now_us();
+    if (transform != 0 && d->jpg_decoder.dct_rotate && decode_rotated_frame(d, w, f, out, transform))
+        return;
+
+    received = atomic_load_explicit(&f->received, memory_order_acquire);
+
+    t = trace_begin();
+    if (received < f->length) {
+        ok = jpgdec_decode_stream(&d->jpg_decoder.jpg, f->data, (unsigned long)f->length, received,
+                wait_frame_bytes, d, decoded, d->jpg_decoder.m_width, d->jpg_decoder.m_height);
+    } else {
+        ok = jpgdec_decode(&d->jpg_decoder.jpg, f->data, (unsigned long)f->length,
+                decoded, d->jpg_decoder.m_width, d->jpg_decoder.m_height);
+    }
+    trace_end("decode", t);
+    if (ok) {
+        f->ts[FRAME_DECODE_END] = now_us();
+        for (i = 0; i < d->webcam_count; i++) {
+            w = &d->webcams[i];
+            decoder_share_frame(d, w, decoded, (i == 0) ? out : decoder_output_buffer(d, w), w->transform, f->ts);
         }
-        jpeg_read_raw_data(dinfo, yuvptr, dinfo->max_v_samp_factor*DCTSIZE);
     }
-    jpeg_finish_decompress(dinfo);
-    decoder_share_frame();
 }
 
 static void apply_transform_helper(const uint8_t *src, uint8_t *dst,
@@ -492,132 +724,119 @@ static void apply_transform_helper(const uint8_t *src, uint8_t *dst,
     }
 }
 
-/* scratch is a working buffer of 2*ySize (2 * w * h) length */
-static void apply_transform(BYTE *yuv420image, BYTE *scratch){
+/* scratch is a working buffer of ySize (w * h) length. The chroma planes
+ * are transformed at their own resolution: the scale matrix has no offset
+ * so it applies as is, angle_matrix_uv has the offsets halved. */
+static void apply_transform(struct webcam_s *w, BYTE *yuv420image, BYTE *scratch){
+    BYTE *p;
 
-    // Transform Y component as is
+    // Transform Y component
     apply_transform_helper(yuv420image, scratch,
-        WEBCAM_W, WEBCAM_H, 0,
-        jpg_decoder.scale_matrix);
+        w->width, w->height, 0,
+        w->scale_matrix);
 
     apply_transform_helper(scratch, yuv420image,
-        WEBCAM_W, WEBCAM_H, 0,
-        jpg_decoder.angle_matrix);
-
-    // Expand U component, transform, then sub-sample back down
-    int row, col;
-    BYTE *p = &yuv420image[jpg_decoder.m_webcam_ySize];
-    BYTE *d = &scratch[jpg_decoder.m_webcam_ySize];
-
-    for (row = 0; row < WEBCAM_H; row += 2) {
-        for (col = 0; col < WEBCAM_W; col += 2) {
-            BYTE u = *p++;
-            scratch[(row+0) * WEBCAM_W + col+0] = u;
-            scratch[(row+0) * WEBCAM_W + col+1] = u;
-            scratch[(row+1) * WEBCAM_W + col+0] = u;
-            scratch[(row+1) * WEBCAM_W + col+1] = u;
-        }
-    }
-
-    apply_transform_helper(scratch, d,
-        WEBCAM_W, WEBCAM_H, 0,
-        jpg_decoder.scale_matrix);
-
-    apply_transform_helper(d, scratch,
-        WEBCAM_W, WEBCAM_H, 128,
-        jpg_decoder.angle_matrix);
+        w->width, w->height, 0,
+        w->angle_matrix);
+
+    // Transform U component
+    p = &yuv420image[w->m_webcam_ySize];
+    apply_transform_helper(p, scratch,
+        w->width / 2, w->height / 2, 0,
+        w->scale_matrix);
+
+    apply_transform_helper(scratch, p,
+        w->width / 2, w->height / 2, 128,
+        w->angle_matrix_uv);
+
+    // Transform V component
+    p = &yuv420image[w->m_webcam_ySize + w->m_webcam_uvSize];
+    apply_transform_helper(p, scratch,
+        w->width / 2, w->height / 2, 0,
+        w->scale_matrix);
+
+    apply_transform_helper(scratch, p,
+        w->width / 2, w->height / 2, 128,
+        w->angle_matrix_uv);
+}
 
-    p = &yuv420image[jpg_decoder.m_webcam_ySize];
-    for (row = 0; row < WEBCAM_H; row += 2) {
-        for (col = 0; col < WEBCAM_W; col += 2) {
-            *p++ = scratch[row*WEBCAM_W + col];
-        }
+/* [ yuv420 decoded ] -> [ yuv420 scaled ] -> [ yuv420 webcam transformed ]
+ * with the last stage writing to 'out'.
+ * 'decoded' may only be 'out' itself when there is nothing to do. */
+static void decoder_transform_frame(struct decoder_s *d, struct webcam_s *w, BYTE *decoded, BYTE *out, int transform) {
+    BYTE *p = decoded;
+    uint64_t t;
+
+    if (transform != 0 && d->jpg_decoder.use_remap
+        && (transform != TRANSFORM_ROT180 || w->swc != NULL)
+        && transform_remap_init(&w->remap, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight,
+            w->width, w->height, transform)) {
+        t = trace_begin();
+        transform_remap(&w->remap, decoded, out);
+        trace_end("remap", t);
     }
-
-    // Expand V component, transform, then sub-sample back down
-    p = &yuv420image[jpg_decoder.m_webcam_ySize + jpg_decoder.m_webcam_uvSize];
-    d = &scratch[jpg_decoder.m_webcam_ySize];
-
-    for (row = 0; row < WEBCAM_H; row += 2) {
-        for (col = 0; col < WEBCAM_W; col += 2) {
-            BYTE v = *p++;
-            scratch[(row+0) * WEBCAM_W + col+0] = v;
-            scratch[(row+0) * WEBCAM_W + col+1] = v;
-            scratch[(row+1) * WEBCAM_W + col+0] = v;
-            scratch[(row+1) * WEBCAM_W + col+1] = v;
+    else if ((transform == TRANSFORM_ROT90 || transform == TRANSFORM_ROT270) && w->swc_rot != NULL) {
+        scale_frame(w->swc_rot, decoded, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight,
+            d->jpg_decoder.scratchBuf, w->m_rotWidth, w->m_rotHeight, 0, 0);
+        t = trace_begin();
+        transform_rotate_yuv420(d->jpg_decoder.scratchBuf, w->m_rotWidth, w->m_rotHeight,
+            out, w->width, w->height, transform);
+        trace_end("rotate", t);
+    }
+    else if (transform == TRANSFORM_ROT180) {
+        if (w->swc != NULL) {
+            scale_frame(w->swc, decoded, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight,
+                d->jpg_decoder.scratchBuf, w->width, w->height, 0, 0);
+            p = d->jpg_decoder.scratchBuf;
         }
+        t = trace_begin();
+        transform_rotate_yuv420(p, w->width, w->height, out, w->width, w->height, transform);
+        trace_end("rotate", t);
     }
-    apply_transform_helper(scratch, d,
-        WEBCAM_W, WEBCAM_H, 0,
-        jpg_decoder.scale_matrix);
-
-    apply_transform_helper(d, scratch,
-        WEBCAM_W, WEBCAM_H, 128,
-        jpg_decoder.angle_matrix);
+    else {
+        if (w->swc != NULL) {
+            scale_frame(w->swc, decoded, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight,
+                out, w->width, w->height, 0, 0);
+        } else if (decoded != out) {
+            memcpy(out, decoded, w->m_webcamYuvSize);
+        }
 
-    p = &yuv420image[jpg_decoder.m_webcam_ySize + jpg_decoder.m_webcam_uvSize];
-    for (row = 0; row < WEBCAM_H; row += 2) {
-        for (col = 0; col < WEBCAM_W; col += 2) {
-            *p++ = scratch[row*WEBCAM_W + col];
+        // todo: This is currently super inefficient unfortunately :(
+        if (transform != 0) {
+            t = trace_begin();
+            apply_transform(w, out, d->jpg_decoder.scratchBuf);
+            trace_end("apply_transform", t);
         }
     }
 }
 
-static void decoder_share_frame() {
-    BYTE *p = jpg_decoder.m_decodeBuf;
-    if (jpg_decoder.swc != NULL) {
-        uint8_t* srcSlice[4];
-        uint8_t* dstSlice[4];
-
-        int srcStride[4] = {
-            jpg_decoder.m_width,
-            jpg_decoder.m_width>>1,
-            jpg_decoder.m_width>>1,
-        0};
-        int dstStride[4] = {
-            WEBCAM_W,
-            WEBCAM_W>>1,
-            WEBCAM_W>>1,
-        0};
-
-        srcSlice[0] = &jpg_decoder.m_decodeBuf[0];
-        srcSlice[1] = srcSlice[0] + jpg_decoder.m_ySize;
-        srcSlice[2] = srcSlice[1] + jpg_decoder.m_uvSize;
-        srcSlice[3] = NULL;
-        dstSlice[0] = &jpg_decoder.m_webcamBuf[0];
-        dstSlice[1] = dstSlice[0] + jpg_decoder.m_webcam_ySize;
-        dstSlice[2] = dstSlice[1] + jpg_decoder.m_webcam_uvSize;
-        dstSlice[3] = NULL;
-
-        sws_scale(jpg_decoder.swc, srcSlice, srcStride, 0, jpg_decoder.m_height, dstSlice, dstStride);
-        p = jpg_decoder.m_webcamBuf;
-    }
-
-    // todo: This is currently super inefficient unfortunately :(
-    if (jpg_decoder.transform != 0) {
-        apply_transform(p, jpg_decoder.scratchBuf);
-    }
-
-    write(droidcam_device_fd, p, jpg_decoder.m_webcamYuvSize);
+/* The decoded frame, finished in 'out', goes to the device */
+static void decoder_share_frame(struct decoder_s *d, struct webcam_s *w, BYTE *decoded, BYTE *out, int transform, uint64_t *ts) {
+    decoder_transform_frame(d, w, decoded, out, transform);
+    decoder_output_frame(w, out, ts);
 }
 
-void decoder_show_test_image() {
+void decoder_show_test_image(struct decoder_s *d) {
     int i,j;
-    int m_height = WEBCAM_H * 2;
-    int m_width  = WEBCAM_W * 2;
+    int m_height = d->webcam_h * 2;
+    int m_width  = d->webcam_w * 2;
+    struct webcam_s *w;
     char header[8];
 
     header[0] = ( m_width >> 8  ) & 0xFF;
     header[1] = ( m_width >> 0  ) & 0xFF;
     header[2] = ( m_height >> 8 ) & 0xFF;
     header[3] = ( m_height >> 0 ) & 0xFF;
-    decoder_prepare_video(header);
+    if (!decoder_prepare_video(d, header))
+        return;
+    m_height = d->jpg_decoder.m_decodeHeight;
+    m_width  = d->jpg_decoder.m_decodeWidth;
 
     // [ jpg ] -> [ yuv420 ] -> [ yuv420 scaled ] -> [ yuv420 webcam transformed ]
 
     // fill in "decoded" data
-    BYTE *p = jpg_decoder.m_decodeBuf;
-    memset(p, 128, jpg_decoder.m_Yuv420Size);
+    BYTE *p = d->jpg_decoder.m_decodeBuf;
+    memset(p, 128, d->jpg_decoder.m_Yuv420Size);
     for (j = 0; j < m_height; j++) {
         BYTE *line_end = p + m_width;
         for (i = 0; i < (m_width / 4); i++) {
@@ -635,11 +854,14 @@ void decoder_show_test_image() {
         while (p < line_end) p++;
     }
 
-    decoder_share_frame();
-    decoder_rotate();
+    for (i = 0; i < d->webcam_count; i++) {
+        w = &d->webcams[i];
+        decoder_share_frame(d, w, d->jpg_decoder.m_decodeBuf, decoder_output_buffer(d, w), w->transform, NULL);
+    }
+    decoder_rotate(d);
 }
 
-static void decoder_set_stransform(int value) {
+static void decoder_set_stransform(struct webcam_s *w, int value) {
     float scale =  1.0f;
     float moveX = 0;
     float moveY = 0;
@@ -656,68 +878,358 @@ static void decoder_set_stransform(int value) {
     // }
     // printf("r=%f,sx=%f,sy=%f,sc=%f\n", rot, moveX, moveY, scale);
 
-    jpg_decoder.transform = value;
+    w->transform = value;
     if (value == 1) {
         rot = 90;
-        scale = WEBCAM_Wf / WEBCAM_Hf;
-        moveX = WEBCAM_Hf;
-        moveY = (WEBCAM_Hf / scale - WEBCAM_Wf) / 2.0f;
+        scale = ((float)w->width) / ((float)w->height);
+        moveX = ((float)w->height);
+        moveY = (((float)w->height) / scale - ((float)w->width)) / 2.0f;
     }
     else if (value == 2) {
         rot = 180;
-        moveX = WEBCAM_Wf;
-        moveY = WEBCAM_Hf;
+        moveX = ((float)w->width);
+        moveY = ((float)w->height);
     }
     else if (value == 3) {
         rot = 270;
-        scale = WEBCAM_Wf / WEBCAM_Hf;
-        moveY = WEBCAM_Hf;
+        scale = ((float)w->width) / ((float)w->height);
+        moveY = ((float)w->height);
     }
     else {
-        jpg_decoder.transform = 0;
+        w->transform = 0;
     }
 
     rot = rot * M_PI / 180.0f; // deg -> rad
 
-    fill_matrix(0, 0, 0, scale, jpg_decoder.scale_matrix);
-    fill_matrix(moveX, moveY, rot, 1.0f, jpg_decoder.angle_matrix);
+    fill_matrix(0, 0, 0, scale, w->scale_matrix);
+    fill_matrix(moveX, moveY, rot, 1.0f, w->angle_matrix);
+    fill_matrix(moveX / 2.0f, moveY / 2.0f, rot, 1.0f, w->angle_matrix_uv);
+}
+
+void decoder_rotate(struct decoder_s *d) {
+    int i;
+    for (i = 0; i < d->webcam_count; i++)
+        decoder_set_stransform(&d->webcams[i], d->webcams[i].transform+1);
+}
+
+/* One stage of the pipeline on its own, on the calling thread, for the
+ * stream set up by decoder_prepare_video(d). Returns FALSE if the stage
+ * has nothing to do for this stream and webcam size. */
+int decoder_bench_stage(struct decoder_s *d, int stage, struct jpg_frame_s *f, int transform) {
+    struct webcam_s *w = &d->webcams[0];
+
+    switch (stage) {
+    case BENCH_DECODE:
+        decoder_set_stransform(w, TRANSFORM_NONE);
+        f->ts[FRAME_SUBMIT] = 0;
+        decode_next_frame(d, f);
+        return f->ts[FRAME_SUBMIT] != 0;
+    case BENCH_SCALE:
+        if (w->swc == NULL)
+            return FALSE;
+        scale_frame(w->swc, d->jpg_decoder.m_decodeBuf, d->jpg_decoder.m_decodeWidth, d->jpg_decoder.m_decodeHeight,
+            d->jpg_decoder.m_webcamBuf, w->width, w->height, 0, 0);
+        return TRUE;
+    case BENCH_TRANSFORM:
+        decoder_transform_frame(d, w, d->jpg_decoder.m_decodeBuf, d->jpg_decoder.m_webcamBuf, transform);
+        return TRUE;
+    case BENCH_APPLY_TRANSFORM:
+        decoder_set_stransform(w, transform);
+        apply_transform(w, d->jpg_decoder.m_webcamBuf, d->jpg_decoder.scratchBuf);
+        return TRUE;
+    case BENCH_OUTPUT:
+        decoder_output_frame(w, d->jpg_decoder.m_webcamBuf, NULL);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static int stats_bucket(uint64_t v, unsigned base) {
+    int i;
+    for (i = 0; i < STATS_BUCKETS - 1 && v > ((uint64_t)base << i); i++)
+        ;
+    return i;
+}
+
+static void stats_stage(struct decoder_s *d, int stage, uint64_t from, uint64_t to) {
+    if (from == 0 || to < from)
+        return;
+    atomic_fetch_add_explicit(&d->stats.stage_hist[stage][stats_bucket(to - from, STATS_TIME_BASE)], 1,
+        memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->stats.stage_sum[stage], to - from, memory_order_relaxed);
 }
 
-void decoder_rotate() {
-    decoder_set_stransform(jpg_decoder.transform+1);
+/* Decode thread: publish the stamps of a frame that went out. The last
+ * byte may still be on its way if the decoder finished before it. */
+static void stats_frame_out(struct decoder_s *d, struct jpg_frame_s *f) {
+    int i;
+    uint64_t t;
+    unsigned seq = atomic_load_explicit(&d->stats.seq, memory_order_relaxed);
+    int complete = atomic_load_explicit(&f->received, memory_order_acquire) >= f->length;
+
+    if (complete)
+        stats_stage(d, STAGE_RECEIVE, f->ts[FRAME_FIRST_BYTE], f->ts[FRAME_LAST_BYTE]);
+    stats_stage(d, STAGE_DECODE, f->ts[FRAME_DECODE_START], f->ts[FRAME_DECODE_END]);
+    stats_stage(d, STAGE_TRANSFORM, f->ts[FRAME_DECODE_END], f->ts[FRAME_TRANSFORM_END]);
+    stats_stage(d, STAGE_WRITE, f->ts[FRAME_TRANSFORM_END], f->ts[FRAME_SUBMIT]);
+
+    atomic_store_explicit(&d->stats.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (i = 0; i < FRAME_STAMPS; i++) {
+        t = (i == FRAME_LAST_BYTE && !complete) ? 0 : f->ts[i];
+        atomic_store_explicit(&d->stats.last[i], t, memory_order_relaxed);
+    }
+    atomic_store_explicit(&d->stats.seq, seq + 2, memory_order_release);
+    atomic_fetch_add_explicit(&d->stats.frames_out, 1, memory_order_relaxed);
 }
 
-struct jpg_frame_s* decoder_get_next_frame() {
-    while (jpg_decoder.m_BufferedFrames > jpg_decoder.m_BufferLimit) {
-        jpg_decoder.m_BufferedFrames--;
-        jpg_decoder.m_NextFrame = (jpg_decoder.m_NextFrame < (JPG_BACKBUF_MAX-1)) ? (jpg_decoder.m_NextFrame + 1) : 0;
+/* Any thread: counters since startup and the stamps of the last frame out */
+void decoder_get_stats(struct decoder_s *d, struct decoder_stats_s *st) {
+    int i, stage;
+    unsigned seq;
+
+    do {
+        seq = atomic_load_explicit(&d->stats.seq, memory_order_acquire);
+        for (i = 0; i < FRAME_STAMPS; i++)
+            st->last[i] = atomic_load_explicit(&d->stats.last[i], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&d->stats.seq, memory_order_relaxed));
+
+    st->frames_in = atomic_load_explicit(&d->stats.frames_in, memory_order_relaxed);
+    st->frames_out = atomic_load_explicit(&d->stats.frames_out, memory_order_relaxed);
+    st->dropped = atomic_load_explicit(&d->stats.dropped, memory_order_relaxed);
+    st->bytes_in = atomic_load_explicit(&d->stats.bytes_in, memory_order_relaxed);
+    st->buffered = atomic_load_explicit(&d->jpg_ring.head, memory_order_relaxed)
+        - atomic_load_explicit(&d->jpg_ring.tail, memory_order_relaxed);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        st->size_hist[i] = atomic_load_explicit(&d->stats.size_hist[i], memory_order_relaxed);
     }
-    if (jpg_decoder.m_BufferedFrames == jpg_decoder.m_BufferLimit) {
-        // dbgprint("decoding #%2d (have buffered: %d)\n", jpg_decoder.m_NextFrame, jpg_decoder.m_BufferedFrames);
-        decode_next_frame();
-        jpg_decoder.m_BufferedFrames--;
-        jpg_decoder.m_NextFrame = (jpg_decoder.m_NextFrame < (JPG_BACKBUF_MAX-1)) ? (jpg_decoder.m_NextFrame + 1) : 0;
+    for (stage = 0; stage < STATS_STAGES; stage++) {
+        for (i = 0; i < STATS_BUCKETS; i++)
+            st->stage_hist[stage][i] = atomic_load_explicit(&d->stats.stage_hist[stage][i], memory_order_relaxed);
+        st->stage_sum[stage] = atomic_load_explicit(&d->stats.stage_sum[stage], memory_order_relaxed);
     }
+}
+
+/* Decode thread: each frame is decoded once it has been buffered for the
+ * jitter delay. Frames that are followed by one that is already due
+ * would only add to the latency and are dropped, as are frames that would
+ * go out past the latency budget while there is a newer one. */
+static void *decoder_thread_proc(void *args) {
+    struct decoder_s *d = (struct decoder_s *)args;
+    unsigned head, seen, tail = atomic_load_explicit(&d->jpg_ring.tail, memory_order_relaxed);
+    uint64_t now, delay, due, start;
+    struct jpg_frame_s *f;
+    dbgprint("Decode Thread Started\n");
+
+    while (atomic_load_explicit(&d->jpg_ring.running, memory_order_acquire)) {
+        seen = atomic_load(&d->jpg_ring.events);
+        head = atomic_load_explicit(&d->jpg_ring.head, memory_order_acquire);
+        if (head == tail) {
+            ring_wait(d, seen);
+            continue;
+        }
 
-    // a call to this function assumes we are about to get a full frame (or exit on failure).
-    // so increment the # of buffered frames. do this after the while() loop above to
-    // take care of the initial case:
-    jpg_decoder.m_BufferedFrames ++;
+        delay = atomic_load_explicit(&d->jitter.delay_us, memory_order_relaxed);
+        now = now_us();
+        for (; head - tail > 1; tail++) {
+            f = &d->jpg_ring.frames[tail % JPG_BACKBUF_MAX];
+            if (d->jpg_ring.frames[(tail + 1) % JPG_BACKBUF_MAX].ts[FRAME_FIRST_BYTE] + delay <= now) {
+                atomic_fetch_add_explicit(&d->stats.dropped, 1, memory_order_relaxed);
+                continue;
+            }
+            if (d->latency.budget_us > 0 && now + d->latency.proc_us > f->ts[FRAME_FIRST_BYTE] + d->latency.budget_us) {
+                atomic_fetch_add_explicit(&d->stats.dropped, 1, memory_order_relaxed);
+                dbgprint("frame %u over the latency budget, dropped\n", tail);
+                continue;
+            }
+            break;
+        }
+
+        f = &d->jpg_ring.frames[tail % JPG_BACKBUF_MAX];
+        due = f->ts[FRAME_FIRST_BYTE] + delay;
+        if (due > now) {
+            ring_wait_timeout(d, seen, due - now);
+            continue;
+        }
+
+        start = trace_begin();
+        decode_next_frame(d, f);
+        trace_end("frame", start);
+        if (f->ts[FRAME_SUBMIT] != 0) {
+            stats_frame_out(d, f);
+            d->latency.proc_us += ((int64_t)(f->ts[FRAME_SUBMIT] - f->ts[FRAME_DECODE_START])
+                - (int64_t)d->latency.proc_us) / 8;
+        }
+        tail++;
+        atomic_store_explicit(&d->jpg_ring.tail, tail, memory_order_release);
+        // pairs with the fence in decoder_drain(d)
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&d->jpg_ring.drain_waiting, memory_order_relaxed)
+            && atomic_exchange(&d->jpg_ring.drain_waiting, 0))
+            sem_post(&d->jpg_ring.drained);
+    }
+
+    dbgprint("Decode Thread End\n");
+    return 0;
+}
+
+static int decoder_start_thread(struct decoder_s *d) {
+    const char *streaming = getenv("DROIDCAM_STREAM_DECODE");
+    atomic_store(&d->jpg_ring.head, 0);
+    atomic_store(&d->jpg_ring.tail, 0);
+    atomic_store(&d->jpg_ring.events, 0);
+    atomic_store(&d->jpg_ring.waiting, 0);
+    atomic_store(&d->jpg_ring.drain_waiting, 0);
+    atomic_store(&d->jpg_ring.running, 1);
+    d->jpg_ring.dropping = 0;
+    d->jpg_ring.streaming = (streaming == NULL || atoi(streaming) != 0);
+    d->jitter.last_arrival = 0;
+    d->jitter.interval = 0;
+    d->jitter.jitter = 0;
+    atomic_store(&d->jitter.delay_us, d->jitter.min_us);
+    d->latency.proc_us = 0;
+
+    if (sem_init(&d->jpg_ring.ready, 0, 0) < 0) {
+        MSG_LASTERROR("Error: sem_init");
+        return FALSE;
+    }
+    if (sem_init(&d->jpg_ring.drained, 0, 0) < 0) {
+        MSG_LASTERROR("Error: sem_init");
+        sem_destroy(&d->jpg_ring.ready);
+        return FALSE;
+    }
+    if (pthread_create(&d->jpg_ring.thread, NULL, decoder_thread_proc, d) != 0) {
+        MSG_ERROR("Unable to start decode thread");
+        sem_destroy(&d->jpg_ring.ready);
+        sem_destroy(&d->jpg_ring.drained);
+        return FALSE;
+    }
+    pthread_setname_np(d->jpg_ring.thread, "decode");
+    d->jpg_ring.started = 1;
+    return TRUE;
+}
+
+static void decoder_stop_thread(struct decoder_s *d) {
+    if (!d->jpg_ring.started)
+        return;
+
+    atomic_store_explicit(&d->jpg_ring.running, 0, memory_order_release);
+    sem_post(&d->jpg_ring.ready);
+    pthread_join(d->jpg_ring.thread, NULL);
+    sem_destroy(&d->jpg_ring.ready);
+    sem_destroy(&d->jpg_ring.drained);
+    d->jpg_ring.started = 0;
+}
+
+/* Network thread: waits up to 'ms' for the decode thread to be done with
+ * every frame queued. FALSE if it is not by then. */
+int decoder_drain(struct decoder_s *d, unsigned ms) {
+    struct timespec ts;
+
+    if (!d->jpg_ring.started)
+        return TRUE;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    for (;;) {
+        atomic_store(&d->jpg_ring.drain_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&d->jpg_ring.head, memory_order_relaxed)
+            == atomic_load_explicit(&d->jpg_ring.tail, memory_order_acquire))
+            break;
+        if (sem_timedwait(&d->jpg_ring.drained, &ts) < 0 && errno == ETIMEDOUT) {
+            atomic_store(&d->jpg_ring.drain_waiting, 0);
+            return FALSE;
+        }
+    }
+    atomic_store(&d->jpg_ring.drain_waiting, 0);
+    return TRUE;
+}
+
+static void ring_queue_frame(struct decoder_s *d) {
+    d->jpg_ring.queued = 1;
+    atomic_fetch_add_explicit(&d->jpg_ring.head, 1, memory_order_release);
+    ring_signal(d);
+}
+
+/* Network thread: returns the slot to receive the next frame into.
+ * If the decode thread has fallen behind and the ring is full, the frame
+ * goes to the spare slot and is dropped in decoder_put_next_frame(d). */
+struct jpg_frame_s* decoder_get_next_frame(struct decoder_s *d) {
+    unsigned head = atomic_load_explicit(&d->jpg_ring.head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&d->jpg_ring.tail, memory_order_acquire);
+    struct jpg_frame_s *f;
+
+    d->jpg_ring.queued = 0;
+    d->jpg_ring.dropping = (head - tail >= JPG_BACKBUF_MAX);
+    if (d->jpg_ring.dropping) {
+        f = &d->jpg_ring.frames[JPG_BACKBUF_MAX];
+    } else {
+        f = &d->jpg_ring.frames[head % JPG_BACKBUF_MAX];
+    }
+    f->length = 0;
+    memset(f->ts, 0, sizeof(f->ts));
+    atomic_store_explicit(&f->received, 0, memory_order_relaxed);
+    return f;
+}
+
+/* Network thread: the frame length is known. Returns FALSE if it does not
+ * fit the slot. With streaming decode the frame is queued right away. */
+int decoder_begin_frame(struct decoder_s *d, struct jpg_frame_s *f, unsigned length) {
+    if (length == 0 || length > (unsigned)d->jpg_decoder.m_Yuv420Size) {
+        errprint("Invalid frame length %u\n", length);
+        return FALSE;
+    }
+    f->length = length;
+    f->ts[FRAME_FIRST_BYTE] = now_us();
+    atomic_fetch_add_explicit(&d->stats.bytes_in, length, memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->stats.size_hist[stats_bucket(length, STATS_SIZE_BASE)], 1, memory_order_relaxed);
+    jitter_update(d, f->ts[FRAME_FIRST_BYTE]);
+    if (d->jpg_ring.streaming && !d->jpg_ring.dropping)
+        ring_queue_frame(d);
+    return TRUE;
+}
+
+/* Network thread: 'received' bytes of the frame are in place */
+void decoder_frame_progress(struct decoder_s *d, struct jpg_frame_s *f, unsigned received) {
+    if (received >= f->length)
+        f->ts[FRAME_LAST_BYTE] = now_us();
+    atomic_store_explicit(&f->received, received, memory_order_release);
+    if (d->jpg_ring.queued)
+        ring_signal(d);
+}
+
+/* Network thread: the slot from decoder_get_next_frame(d) holds a full frame */
+void decoder_put_next_frame(struct decoder_s *d) {
+    atomic_fetch_add_explicit(&d->stats.frames_in, 1, memory_order_relaxed);
+    if (d->jpg_ring.dropping) {
+        atomic_fetch_add_explicit(&d->stats.dropped, 1, memory_order_relaxed);
+        dbgprint("ring full, dropping frame\n");
+        return;
+    }
+    if (!d->jpg_ring.queued)
+        ring_queue_frame(d);
+}
 
-    int nextSlotSaved = jpg_decoder.m_NextSlot;
-    jpg_decoder.m_NextSlot = (jpg_decoder.m_NextSlot < (JPG_BACKBUF_MAX-1)) ? (jpg_decoder.m_NextSlot + 1) : 0;
-    // dbgprint("next image going to #%2d (have buffered: %d)\n", nextSlotSaved, (jpg_decoder.m_BufferedFrames-1));
-    return &jpg_frames[nextSlotSaved];
+void decoder_get_frame_memory(struct decoder_s *d, BYTE **base, size_t *size) {
+    *base = d->jpg_decoder.m_inBuf;
+    *size = d->jpg_decoder.m_Yuv420Size * (JPG_BACKBUF_MAX + 1) + 4096;
 }
 
-int decoder_get_video_width() {
-    return WEBCAM_W;
+int decoder_get_video_width(struct decoder_s *d) {
+    return d->webcam_w;
 }
 
-int decoder_get_video_height(){
-    return WEBCAM_H;
+int decoder_get_video_height(struct decoder_s *d){
+    return d->webcam_h;
 }
 
-int decoder_get_audio_frame_size(void) {
-    return spx_decoder.frame_size; //20ms for wb speex
+int decoder_get_audio_frame_size(struct decoder_s *d) {
+    return d->spx_decoder.frame_size; //20ms for wb speex
 }
@@ -10,25 +10,97 @@
 #ifndef __DECODR_H__
 #define __DECODR_H__
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef unsigned char BYTE;
 
+/* Pipeline stages a frame is timestamped at, CLOCK_MONOTONIC usecs */
+enum frame_stamp {
+ FRAME_FIRST_BYTE,      /* length header received */
+ FRAME_LAST_BYTE,
+ FRAME_DECODE_START,
+ FRAME_DECODE_END,
+ FRAME_TRANSFORM_END,   /* scaled/rotated into the output buffer */
+ FRAME_SUBMIT,          /* handed to the loopback device */
+ FRAME_STAMPS
+};
+
 struct jpg_frame_s {
  BYTE *data;
  unsigned length;
+ atomic_uint received;  /* bytes of data in place so far */
+ uint64_t ts[FRAME_STAMPS];
+};
+
+/* Stages of the time histograms, between the stamps above. 'transform'
+ * covers scaling as well, the two are one pass for rotated frames. */
+enum stats_stage {
+ STAGE_RECEIVE,         /* first to last byte */
+ STAGE_DECODE,
+ STAGE_TRANSFORM,
+ STAGE_WRITE,
+ STATS_STAGES
+};
+
+/* Histogram bucket i counts values up to base << i, the last one the rest */
+#define STATS_BUCKETS   10
+#define STATS_SIZE_BASE 8192    /* JPEG bytes */
+#define STATS_TIME_BASE 250     /* usecs */
+
+struct decoder_stats_s {
+ unsigned frames_in;
+ unsigned frames_out;
+ unsigned dropped;
+ unsigned buffered;            /* frames waiting in the ring */
+ uint64_t bytes_in;
+ uint64_t last[FRAME_STAMPS];  /* stamps of the last frame that went out */
+ unsigned size_hist[STATS_BUCKETS];
+ unsigned stage_hist[STATS_STAGES][STATS_BUCKETS];
+ uint64_t stage_sum[STATS_STAGES];  /* usecs */
 };
 
-int  decoder_init();
-void decoder_fini();
+/* Per stream decoder context, see decoder.c */
+struct decoder_s;
+
+/* Output names are as for DROIDCAM_OUTPUT, see decoder_init_sink() */
+struct decoder_s *decoder_init(void);
+struct decoder_s *decoder_init_sink(const char *output);
+struct decoder_s *decoder_init_output(int sink, const char *arg, int width, int height);
+void decoder_fini(struct decoder_s *d);
 
-int  decoder_prepare_video(char * header);
-void decoder_cleanup();
+int  decoder_prepare_video(struct decoder_s *d, char * header);
+void decoder_cleanup(struct decoder_s *d);
+
+struct jpg_frame_s* decoder_get_next_frame(struct decoder_s *d);
+int  decoder_begin_frame(struct decoder_s *d, struct jpg_frame_s *f, unsigned length);
+void decoder_frame_progress(struct decoder_s *d, struct jpg_frame_s *f, unsigned received);
+void decoder_put_next_frame(struct decoder_s *d);
+/* Waits up to 'ms' for every frame put to be decoded; FALSE if they are not */
+int  decoder_drain(struct decoder_s *d, unsigned ms);
+/* The memory all the frame slots are in, for registering it with the
+ * kernel; valid from decoder_prepare_video(d) to decoder_cleanup(d) */
+void decoder_get_frame_memory(struct decoder_s *d, BYTE **base, size_t *size);
+void decoder_set_video_delay(struct decoder_s *d, unsigned ms);
+void decoder_get_stats(struct decoder_s *d, struct decoder_stats_s *st);
+int decoder_get_video_width(struct decoder_s *d);
+int decoder_get_video_height(struct decoder_s *d);
+void decoder_rotate(struct decoder_s *d);
+void decoder_show_test_image(struct decoder_s *d);
+
+/* Pipeline stages for droidcam-bench to time one by one */
+enum decoder_bench_stage {
+ BENCH_DECODE,          /* decode_next_frame(), the whole way to the device */
+ BENCH_SCALE,           /* sws_scale to the webcam size */
+ BENCH_TRANSFORM,       /* the rotation step, as configured */
+ BENCH_APPLY_TRANSFORM, /* the float matrix rotation on its own */
+ BENCH_OUTPUT,          /* handing a frame to the device */
+ BENCH_STAGES
+};
 
-struct jpg_frame_s* decoder_get_next_frame();
-void decoder_set_video_delay(unsigned v);
-int decoder_get_video_width();
-int decoder_get_video_height();
-void decoder_rotate();
-void decoder_show_test_image();
+struct decoder_s *decoder_init_bench(int width, int height);
+int  decoder_bench_stage(struct decoder_s *d, int stage, struct jpg_frame_s *f, int transform);
 
 /* 20ms 16hkz 16 bit */
 #define DROIDCAM_CHUNK_MS_2           20
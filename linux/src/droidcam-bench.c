@@ -0,0 +1,488 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "common.h"
+#include "decoder.h"
+#include "jpgdec.h"
+#include "transform.h"
+
+struct corpus_frame_s {
+ BYTE *data;
+ unsigned long length;
+};
+
+static struct corpus_frame_s *frames;
+static int num_frames;
+static int width, height;
+
+void ShowError(const char * title, const char * msg) {
+    errprint("%s: %s\n", title, msg);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int load_frame(const char *path, struct corpus_frame_s *f) {
+    long size;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        errprint("%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    f->data = (BYTE*)malloc(size);
+    f->length = (unsigned long)size;
+    if (f->data == NULL || fread(f->data, 1, size, fp) != (size_t)size) {
+        errprint("%s: read failed\n", path);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+}
+
+static int probe_size(void) {
+    int subsamp, colorspace;
+    tjhandle tj = tjInitDecompress();
+    if (tj == NULL) {
+        errprint("turbojpeg init failed\n");
+        return 0;
+    }
+    if (tjDecompressHeader3(tj, frames[0].data, frames[0].length, &width, &height, &subsamp, &colorspace) < 0) {
+        errprint("unable to read the first frame header: %s\n", tjGetErrorStr2(tj));
+        tjDestroy(tj);
+        return 0;
+    }
+    tjDestroy(tj);
+    return 1;
+}
+
+static void run_backend(int backend, int repeat, BYTE *yuv) {
+    struct jpgdec_s dec;
+    int i, r, failed = 0;
+    double start, elapsed;
+
+    if (!jpgdec_init(&dec, backend) || dec.backend != backend) {
+        errprint("%s: backend unavailable\n", jpgdec_backend_name(backend));
+        jpgdec_fini(&dec);
+        return;
+    }
+
+    // warm up caches and the libjpeg row tables
+    for (i = 0; i < num_frames; i++)
+        jpgdec_decode(&dec, frames[i].data, frames[i].length, yuv, width, height);
+
+    start = now_us();
+    for (r = 0; r < repeat; r++) {
+        for (i = 0; i < num_frames; i++) {
+            if (!jpgdec_decode(&dec, frames[i].data, frames[i].length, yuv, width, height))
+                failed++;
+        }
+    }
+    elapsed = now_us() - start;
+
+    printf("%-10s %dx%d frames=%d failed=%d  %8.1f us/frame  %7.1f fps  %7.1f Mpix/s\n",
+        jpgdec_backend_name(backend), width, height, num_frames * repeat, failed,
+        elapsed / (num_frames * repeat),
+        (num_frames * repeat) * 1e6 / elapsed,
+        (double)width * height * num_frames * repeat / elapsed);
+
+    jpgdec_fini(&dec);
+}
+
+/* The pipeline matrix: every stream size into every webcam size. The app
+ * sends frames in whole 16x16 MCUs, so its 1080p is 1088 lines. */
+static const int stream_sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1088} };
+static const int webcam_sizes[][2] = { {320, 240}, {640, 480}, {1280, 720}, {1920, 1080} };
+#define NUM_SIZES(a) (int)(sizeof(a) / sizeof(a[0]))
+
+static const char *stage_names[BENCH_STAGES] = {
+    "decode", "scale", "transform", "apply_transform", "output",
+};
+
+static uint64_t cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* A 4:2:0 JPEG like the app sends: bars, a gradient and a noisy patch */
+static int make_frame(int w, int h, struct corpus_frame_s *f) {
+    int x, y, ok;
+    BYTE *yuv = (BYTE*)malloc(w * h * 3 / 2), *p = yuv;
+    tjhandle tj = tjInitCompress();
+
+    if (yuv == NULL || tj == NULL) {
+        free(yuv);
+        return 0;
+    }
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++)
+            *p++ = (x < w / 2) ? (x * 4 / w) * 64 : (x + y) & 0xFF;
+        if (y >= h / 4 && y < h / 2)
+            for (x = w / 4; x < w / 2; x++) yuv[y * w + x] = rand() & 0xFF;
+    }
+    for (y = 0; y < h / 2; y++)
+        for (x = 0; x < w; x++) *p++ = 128 + (x + y) % 64 - 32;
+
+    f->data = NULL;
+    f->length = 0;
+    ok = tjCompressFromYUV(tj, yuv, w, 1, h, TJSAMP_420, &f->data, &f->length, 80, TJFLAG_FASTDCT) == 0;
+    if (!ok)
+        errprint("compress %dx%d: %s\n", w, h, tjGetErrorStr2(tj));
+    tjDestroy(tj);
+    free(yuv);
+    return ok;
+}
+
+/* Runs a stage at least 'repeat' times or for half a second, whichever
+ * is shorter, after a warm-up; appends a JSON record to 'out'. */
+static void run_stage(FILE *out, int *first, struct decoder_s *d, struct jpg_frame_s *f, int stage, int transform,
+                      int sw, int sh, int ww, int wh, int repeat) {
+    int n;
+    double start, elapsed;
+    uint64_t c0, c1;
+    double pixels, bytes;
+
+    if (!decoder_bench_stage(d, stage, f, transform) || !decoder_bench_stage(d, stage, f, transform))
+        return;
+
+    c0 = cycles();
+    start = now_us();
+    for (n = 0; n < repeat && (n < 3 || now_us() - start < 500000); n++)
+        decoder_bench_stage(d, stage, f, transform);
+    elapsed = now_us() - start;
+    c1 = cycles();
+
+    // decoding is per stream pixel and JPEG byte, the rest per webcam
+    // pixel and YUV420 byte
+    pixels = (stage == BENCH_DECODE) ? (double)sw * sh : (double)ww * wh;
+    bytes = (stage == BENCH_DECODE) ? (double)f->length : (double)ww * wh * 3 / 2;
+
+    fprintf(out, "%s\n  {\"stage\": \"%s\", \"transform\": %d, \"stream\": \"%dx%d\", \"webcam\": \"%dx%d\", "
+        "\"frames\": %d, \"ns_per_frame\": %.0f, \"mb_per_s\": %.1f, \"cycles_per_pixel\": ",
+        *first ? "" : ",", stage_names[stage], transform, sw, sh, ww, wh,
+        n, elapsed * 1e3 / n, bytes * n / elapsed);
+    if (c1 > c0)
+        fprintf(out, "%.2f}", (double)(c1 - c0) / n / pixels);
+    else
+        fprintf(out, "null}");
+    *first = 0;
+}
+
+/* Every stage of the frame pipeline over the size matrix, as JSON */
+static int run_pipeline(FILE *out, int repeat) {
+    int s, w, t, first = 1;
+    char header[5];
+    struct corpus_frame_s jpg;
+    struct jpg_frame_s f;
+    struct decoder_s *d;
+
+    fprintf(out, "{\"simd\": \"%s\", \"tsc\": %s, \"results\": [",
+        transform_simd_name(transform_simd_level()), cycles() ? "true" : "false");
+    for (s = 0; s < NUM_SIZES(stream_sizes); s++) {
+        int sw = stream_sizes[s][0], sh = stream_sizes[s][1];
+        if (!make_frame(sw, sh, &jpg))
+            return 0;
+        header[0] = (sw >> 8) & 0xFF; header[1] = sw & 0xFF;
+        header[2] = (sh >> 8) & 0xFF; header[3] = sh & 0xFF;
+        header[4] = 0;
+
+        for (w = 0; w < NUM_SIZES(webcam_sizes); w++) {
+            int ww = webcam_sizes[w][0], wh = webcam_sizes[w][1];
+            errprint("%dx%d -> %dx%d\n", sw, sh, ww, wh);
+            if ((d = decoder_init_bench(ww, wh)) == NULL)
+                return 0;
+            if (!decoder_prepare_video(d, header)) {
+                decoder_fini(d);
+                return 0;
+            }
+
+            memset(&f, 0, sizeof(f));
+            f.data = jpg.data;
+            f.length = jpg.length;
+            atomic_store(&f.received, f.length);
+
+            run_stage(out, &first, d, &f, BENCH_DECODE, 0, sw, sh, ww, wh, repeat);
+            run_stage(out, &first, d, &f, BENCH_SCALE, 0, sw, sh, ww, wh, repeat);
+            for (t = TRANSFORM_NONE; t <= TRANSFORM_ROT270; t++)
+                run_stage(out, &first, d, &f, BENCH_TRANSFORM, t, sw, sh, ww, wh, repeat);
+            for (t = TRANSFORM_NONE; t <= TRANSFORM_ROT270; t++)
+                run_stage(out, &first, d, &f, BENCH_APPLY_TRANSFORM, t, sw, sh, ww, wh, repeat);
+            run_stage(out, &first, d, &f, BENCH_OUTPUT, 0, sw, sh, ww, wh, repeat);
+
+            decoder_cleanup(d);
+            decoder_fini(d);
+        }
+        tjFree(jpg.data);
+    }
+    fprintf(out, "\n]}\n");
+    return 1;
+}
+
+/* Lowest PSNR the DCT rotation may have against the pixel rotation. Both
+ * sides are the same picture decoded with the fast IDCT, once with its
+ * blocks transposed, so they differ by rounding only; a wrong turn or
+ * mirror of the test frames is far below these (around 10 dB). Through
+ * the pipeline the two sides are also letterboxed by different scalers. */
+#define CHECK_DECODE_DB   35.0
+#define CHECK_PIPELINE_DB 20.0
+
+/* Worst PSNR of the three planes of two w x h YUV420 frames */
+static double psnr_yuv420(const BYTE *a, const BYTE *b, int w, int h) {
+    int p, i, n;
+    double se, db, worst = 99.0;
+
+    for (p = 0; p < 3; p++) {
+        n = (p == 0) ? w * h : w * h / 4;
+        for (se = 0, i = 0; i < n; i++)
+            se += (double)(a[i] - b[i]) * (a[i] - b[i]);
+        db = (se == 0) ? 99.0 : 10 * log10(255.0 * 255.0 * n / se);
+        if (db < worst) worst = db;
+        a += n;
+        b += n;
+    }
+    return worst;
+}
+
+static int check_result(const char *what, int w, int h, double db, double min) {
+    int ok = db >= min;
+    printf("%-28s %4dx%-4d %5.1f dB  %s\n", what, w, h, db, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* The frame decoded by the whole pipeline into a ww x wh webcam turned by
+ * 'transform', with or without DROIDCAM_DCT_ROTATE, read back from a file
+ * sink into 'out' */
+static int pipeline_frame(struct corpus_frame_s *jpg, int sw, int sh, int ww, int wh,
+                          int transform, int dct, BYTE *out) {
+    char path[] = "/tmp/droidcam-check-XXXXXX", spec[96], header[5];
+    struct decoder_s *d;
+    struct jpg_frame_s *f;
+    int fd, ok = 0;
+
+    if ((fd = mkstemp(path)) < 0) {
+        errprint("mkstemp: %s\n", strerror(errno));
+        return 0;
+    }
+    close(fd);
+    snprintf(spec, sizeof(spec), "file:%s@%dx%d@%d", path, ww, wh, transform * 90);
+    setenv("DROIDCAM_DCT_ROTATE", dct ? "1" : "0", 1);
+    header[0] = (sw >> 8) & 0xFF; header[1] = sw & 0xFF;
+    header[2] = (sh >> 8) & 0xFF; header[3] = sh & 0xFF;
+    header[4] = 0;
+
+    if ((d = decoder_init_sink(spec)) == NULL)
+        goto _out;
+    if (decoder_prepare_video(d, header)) {
+        decoder_set_video_delay(d, 0);
+        f = decoder_get_next_frame(d);
+        if (decoder_begin_frame(d, f, jpg->length)) {
+            memcpy(f->data, jpg->data, jpg->length);
+            decoder_frame_progress(d, f, jpg->length);
+            decoder_put_next_frame(d);
+            ok = decoder_drain(d, 5000);
+        }
+        decoder_cleanup(d);
+    }
+    decoder_fini(d);
+
+    if (ok) {
+        FILE *fp = fopen(path, "rb");
+        ok = fp != NULL && fread(out, 1, ww * wh * 3 / 2, fp) == (size_t)(ww * wh * 3 / 2);
+        if (fp) fclose(fp);
+    }
+_out:
+    unlink(path);
+    unsetenv("DROIDCAM_DCT_ROTATE");
+    return ok;
+}
+
+/* The TurboJPEG paths against the plain ones for one w x h frame: the two
+ * decode backends, then for each rotation the lossless DCT rotation against
+ * decoding and rotating the pixels, on its own and through the pipeline */
+static int check_frame(struct corpus_frame_s *jpg, int w, int h) {
+    static const char *names[] = { "", "rot90", "rot180", "rot270" };
+    struct jpgdec_s tj, lj;
+    BYTE *yuv, *ref, *out, *rot;
+    unsigned long rot_len;
+    char what[64];
+    int t, rw, rh, ok = 1, size = w * h * 3 / 2;
+
+    if (!jpgdec_init(&tj, JPGDEC_TURBOJPEG) || tj.backend != JPGDEC_TURBOJPEG) {
+        errprint("TurboJPEG is not available, nothing to check\n");
+        jpgdec_fini(&tj);
+        return 0;
+    }
+    jpgdec_init(&lj, JPGDEC_LIBJPEG);
+    yuv = (BYTE*)malloc(size);
+    ref = (BYTE*)malloc(size);
+    out = (BYTE*)malloc(size);
+    if (yuv == NULL || ref == NULL || out == NULL) {
+        ok = 0;
+        goto _out;
+    }
+
+    if (!jpgdec_decode(&tj, jpg->data, jpg->length, yuv, w, h)
+        || !jpgdec_decode(&lj, jpg->data, jpg->length, ref, w, h)) {
+        printf("%-28s %4dx%-4d decode FAILED\n", "turbojpeg/libjpeg", w, h);
+        ok = 0;
+        goto _out;
+    }
+    ok &= check_result("turbojpeg/libjpeg", w, h, psnr_yuv420(yuv, ref, w, h), CHECK_DECODE_DB);
+
+    for (t = TRANSFORM_ROT90; t <= TRANSFORM_ROT270; t++) {
+        rw = (t == TRANSFORM_ROT180) ? w : h;
+        rh = (t == TRANSFORM_ROT180) ? h : w;
+        transform_rotate_yuv420(yuv, w, h, ref, rw, rh, t);
+
+        // the angle decode_rotated_frame() asks for: TRANSFORM_ROT90 is
+        // counter-clockwise, TurboJPEG turns clockwise
+        snprintf(what, sizeof(what), "dct/pixel %s", names[t]);
+        if (!jpgdec_rotate(&tj, jpg->data, jpg->length, (t == TRANSFORM_ROT90) ? 270 : (t == TRANSFORM_ROT180) ? 180 : 90,
+                &rot, &rot_len) || !jpgdec_decode(&tj, rot, rot_len, out, rw, rh)) {
+            printf("%-28s %4dx%-4d FAILED\n", what, w, h);
+            ok = 0;
+            continue;
+        }
+        ok &= check_result(what, w, h, psnr_yuv420(out, ref, rw, rh), CHECK_DECODE_DB);
+
+        snprintf(what, sizeof(what), "pipeline dct/pixel %s", names[t]);
+        if (!pipeline_frame(jpg, w, h, w, h, t, 0, ref) || !pipeline_frame(jpg, w, h, w, h, t, 1, out)) {
+            printf("%-28s %4dx%-4d FAILED\n", what, w, h);
+            ok = 0;
+            continue;
+        }
+        ok &= check_result(what, w, h, psnr_yuv420(out, ref, w, h), CHECK_PIPELINE_DB);
+    }
+
+_out:
+    free(yuv);
+    free(ref);
+    free(out);
+    jpgdec_fini(&tj);
+    jpgdec_fini(&lj);
+    return ok;
+}
+
+/* check_frame() for the given frames, or for generated ones of every
+ * stream size */
+static int run_check(void) {
+    int i, ok = 1;
+    struct corpus_frame_s jpg;
+
+    if (num_frames > 0) {
+        for (i = 0; i < num_frames; i++)
+            ok &= check_frame(&frames[i], width, height);
+        return ok;
+    }
+    for (i = 0; i < NUM_SIZES(stream_sizes); i++) {
+        if (!make_frame(stream_sizes[i][0], stream_sizes[i][1], &jpg))
+            return 0;
+        ok &= check_frame(&jpg, stream_sizes[i][0], stream_sizes[i][1]);
+        tjFree(jpg.data);
+        if (!ok)
+            break;
+    }
+    return ok;
+}
+
+static void usage(char *argv[]) {
+    fprintf(stderr, "Usage: \n"
+    " %s [-n <repeat>] <frame.jpg> [frame.jpg ...]\n"
+    "   Decode a recorded frame corpus with each JPEG backend\n"
+    "\n"
+    " %s [-n <repeat>] [-o <file.json>]\n"
+    "   Time each stage of the frame pipeline for a matrix of stream and\n"
+    "   webcam sizes, with generated frames, and write the results as JSON\n"
+    "\n"
+    " %s -c [frame.jpg ...]\n"
+    "   Check the TurboJPEG decode and lossless rotation against libjpeg\n"
+    "   and the pixel rotation, on the frames or on generated ones\n"
+    ,
+    argv[0], argv[0], argv[0]);
+}
+
+int main(int argc, char *argv[]) {
+    int i, ok, repeat = 10, check = 0;
+    const char *json = NULL;
+    FILE *out = stdout;
+    BYTE *yuv;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            check = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            repeat = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-o") == 0) {
+            json = argv[++i];
+        } else {
+            break;
+        }
+    }
+    if (repeat < 1 || (i < argc && argv[i][0] == '-')) {
+        usage(argv);
+        return 1;
+    }
+
+    if (check && i == argc)
+        return run_check() ? 0 : 2;
+    if (i == argc) {
+        if (json != NULL && (out = fopen(json, "w")) == NULL) {
+            errprint("%s: %s\n", json, strerror(errno));
+            return 1;
+        }
+        ok = run_pipeline(out, repeat);
+        if (out != stdout) fclose(out);
+        return ok ? 0 : 2;
+    }
+
+    num_frames = argc - i;
+    if (num_frames < 1) {
+        usage(argv);
+        return 1;
+    }
+    frames = (struct corpus_frame_s*)calloc(num_frames, sizeof(struct corpus_frame_s));
+    for (num_frames = 0; i < argc; i++) {
+        if (!load_frame(argv[i], &frames[num_frames]))
+            return 1;
+        num_frames++;
+    }
+
+    if (!probe_size())
+        return 1;
+    if (check)
+        return run_check() ? 0 : 2;
+
+    yuv = (BYTE*)malloc(width * height * 3 / 2);
+    run_backend(JPGDEC_LIBJPEG, repeat, yuv);
+    run_backend(JPGDEC_TURBOJPEG, repeat, yuv);
+    return 0;
+}
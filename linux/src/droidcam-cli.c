@@ -7,48 +7,82 @@
  * Use at your own risk. See README file for more details.
  */
 
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/limits.h>
 
 #include <errno.h>
 #include <string.h>
 
 #include "common.h"
+#include "bufpool.h"
+#include "capture.h"
 #include "connection.h"
 #include "decoder.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
 
-char *g_ip;
-int g_port;
-int v_running;
+/* A phone and the webcam it goes to. With --map there can be several, each
+ * with a pipeline of its own: a thread that receives and a decoder thread. */
+struct stream_s {
+ char *ip;              /* NULL to listen on 'port' */
+ int port;
+ const char *output;    /* see output_sink_from_name(), NULL for the default */
+ char name[32];
+ struct decoder_s *decoder;
+ pthread_t thread;
+};
+
+#define MAX_STREAMS STATS_MAX_STREAMS
+struct stream_s g_streams[MAX_STREAMS];
+int g_stream_count;
+atomic_int v_running;
+char *g_capture;
+char *g_replay;
+int g_fast;
 
 void ShowError(const char * title, const char * msg) {
     errprint("%s: %s\n", title, msg);
 }
 
-void stream_video(void) {
+/* Ctrl-C ends the streams where they are waiting, so the outputs, the
+ * capture and the trace are closed properly */
+static void stop_handler(int sig) {
+    (void)sig;
+    v_running = 0;
+    connection_stop();
+}
+
+void stream_video(struct stream_s *st) {
     char buf[32];
     int keep_waiting = 0;
+    struct decoder_s *d = st->decoder;
+    struct recv_buf_s rb = {0};
     SOCKET videoSocket = INVALID_SOCKET;
 
-    if (g_ip != NULL) {
-        videoSocket = connect_droidcam(g_ip, g_port);
+    if (st->ip != NULL) {
+        videoSocket = connect_droidcam(st->ip, st->port);
         if (videoSocket == INVALID_SOCKET) {
             return;
         }
     }
-    v_running  =1;
 
 server_wait:
     if (videoSocket == INVALID_SOCKET) {
-        videoSocket = accept_connection(g_port);
+        videoSocket = accept_connection(st->port);
         if (videoSocket == INVALID_SOCKET) { goto early_out; }
         keep_waiting = 1;
     }
 
     {
-        int len = snprintf(buf, sizeof(buf), VIDEO_REQ, decoder_get_video_width(), decoder_get_video_height());
+        int len = snprintf(buf, sizeof(buf), VIDEO_REQ, decoder_get_video_width(d), decoder_get_video_height(d));
         if (SendRecv(1, buf, len, videoSocket) <= 0){
             MSG_ERROR("Error sending request, DroidCam might be busy with another client.");
             goto early_out;
@@ -61,69 +95,245 @@ server_wait:
         goto early_out;
     }
 
-    if (decoder_prepare_video(buf) == FALSE) {
+    if (decoder_prepare_video(d, buf) == FALSE) {
         goto early_out;
     }
+    if (g_capture != NULL) {
+        // the first session only
+        capture_start(g_capture, buf);
+        g_capture = NULL;
+    }
 
+    if (uring_enabled() && uring_recv_stream(d, videoSocket)) {
+        goto early_out;
+    }
+    if (!recv_buf_init(&rb, videoSocket)) {
+        goto early_out;
+    }
     while (1){
-        int frameLen;
-        struct jpg_frame_s *f = decoder_get_next_frame();
-        if (SendRecv(0, buf, 4, videoSocket) == FALSE) break;
-        make_int4(frameLen, buf[0], buf[1], buf[2], buf[3]);
-        f->length = frameLen;
-        char *p = (char*)f->data;
-        while (frameLen > 4096) {
-            if (SendRecv(0, p, 4096, videoSocket) == FALSE) goto early_out;
-            frameLen -= 4096;
-            p += 4096;
-        }
-        if (SendRecv(0, p, frameLen, videoSocket) == FALSE) break;
+        if (recv_video_frame(d, &rb) == FALSE) break;
     }
 
 early_out:
-    dbgprint("disconnect\n");
+    dbgprint("%s: disconnect\n", st->name);
+    recv_buf_fini(&rb);
+    capture_stop();
     disconnect(videoSocket);
-    decoder_cleanup();
+    decoder_cleanup(d);
 
-    if (keep_waiting){
+    if (keep_waiting && !connection_stopped()){
         videoSocket = INVALID_SOCKET;
         goto server_wait;
     }
+}
 
-    v_running = 0;
-    connection_cleanup();
+static void *stream_thread_proc(void *args) {
+    stream_video((struct stream_s*)args);
+    return 0;
+}
+
+/* One thread per stream, until they all end */
+void stream_all(void) {
+    int i;
+
+    for (i = 0; i < g_stream_count; i++) {
+        if (pthread_create(&g_streams[i].thread, NULL, stream_thread_proc, &g_streams[i]) != 0) {
+            MSG_LASTERROR("Error: stream thread");
+            break;
+        }
+        pthread_setname_np(g_streams[i].thread, "stream");
+    }
+    while (i-- > 0) {
+        pthread_join(g_streams[i].thread, NULL);
+    }
+}
+
+void replay_video(struct decoder_s *d) {
+    struct replay_s r;
+    struct timespec start, end;
+    unsigned frames = 0;
+    double elapsed;
+
+    if (!replay_open(&r, g_replay))
+        return;
+    if (decoder_prepare_video(d, r.header) == FALSE) {
+        replay_close(&r);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (v_running && replay_video_frame(d, &r, g_fast)) {
+        frames++;
+    }
+    replay_drain(d);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    errprint("replayed %u frames in %.3fs, %.1f fps\n", frames, elapsed, frames / elapsed);
+
+    decoder_cleanup(d);
+    replay_close(&r);
 }
 
 inline void usage(int argc, char *argv[]) {
     fprintf(stderr, "Usage: \n"
-    " %s -l <port>\n"
+    " %s [options] -l <port>\n"
     "   Listen on 'port' for connections\n"
     "\n"
-    " %s <ip> <port>\n"
+    " %s [options] <ip> <port>\n"
     "   Connect to 'ip' on 'port'\n"
+    "\n"
+    " %s [options] --replay <file> [--fast]\n"
+    "   Play back a capture instead of a phone, as recorded or with\n"
+    "   --fast as quickly as every frame can be decoded\n"
+    "\n"
+    " %s [options] --map <src>[=<dev>] [--map ...]\n"
+    "   Run several phones at once. 'src' is <ip>:<port> to connect to,\n"
+    "   or a port to listen on; 'dev' is the /dev/videoN it goes to, or\n"
+    "   an output as in DROIDCAM_OUTPUT, and a comma separated list of\n"
+    "   them gets the same stream. Without it each stream takes the next\n"
+    "   free Droidcam device.\n"
+    "\n"
+    "Options:\n"
+    " --trace <file>\n"
+    "   Write a Chrome/Perfetto trace of the frame pipeline to 'file'\n"
+    " --capture <file>\n"
+    "   Record the stream of the first connection to 'file'\n"
     ,
-    argv[0], argv[0]);
+    argv[0], argv[0], argv[0], argv[0]);
 }
 
 
+static struct stream_s *add_stream(char *ip, int port, const char *output) {
+    struct stream_s *st;
+
+    if (g_stream_count == MAX_STREAMS) {
+        errprint("at most %d streams\n", MAX_STREAMS);
+        return NULL;
+    }
+    st = &g_streams[g_stream_count++];
+    st->ip = ip;
+    st->port = port;
+    st->output = output;
+    if (ip != NULL) {
+        snprintf(st->name, sizeof(st->name), "%s:%d", ip, port);
+    } else {
+        snprintf(st->name, sizeof(st->name), "%d", port);
+    }
+    return st;
+}
+
+/* <ip>:<port> or <port>, then optionally =<dev> */
+static int add_map(char *map) {
+    char *output = strchr(map, '=');
+    char *port;
+
+    if (output != NULL)
+        *output++ = 0;
+    if ((port = strrchr(map, ':')) != NULL) {
+        *port++ = 0;
+    } else {
+        port = map;
+        map = NULL;
+    }
+    if (atoi(port) <= 0) {
+        errprint("bad --map port '%s'\n", port);
+        return FALSE;
+    }
+    return add_stream(map, atoi(port), output) != NULL;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'l') {
-        g_ip = NULL;
-        g_port = atoi(argv[2]);
+    struct decoder_s *decoders[MAX_STREAMS];
+    const char *names[MAX_STREAMS];
+    const char *trace_file = trace_option(&argc, argv);
+    int i, ret = 0;
+
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--fast") == 0) {
+            g_fast = 1;
+            argv++; argc--;
+        } else if (argc > 2 && strcmp(argv[1], "--capture") == 0) {
+            g_capture = argv[2];
+            argv += 2; argc -= 2;
+        } else if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+            g_replay = argv[2];
+            argv += 2; argc -= 2;
+        } else if (argc > 2 && strcmp(argv[1], "--map") == 0) {
+            if (!add_map(argv[2]))
+                return 1;
+            argv += 2; argc -= 2;
+        } else {
+            break;
+        }
+    }
+
+    if (g_stream_count > 0 && argc == 1 && g_replay == NULL && g_capture == NULL) {
+        // --map
+    }
+    else if (g_stream_count > 0) {
+        errprint("--map takes no other phone, and no --capture or --replay\n");
+        return 1;
+    }
+    else if (g_replay != NULL && argc == 1) {
+        // frames go in one at a time, a playout delay would only slow it down
+        if (g_fast) setenv("DROIDCAM_MAX_DELAY_MS", "0", 1);
+        add_stream(NULL, 0, NULL);
+    }
+    else if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'l') {
+        add_stream(NULL, atoi(argv[2]), NULL);
     }
     else if (argc == 3) {
-        g_ip = argv[1];
-        g_port = atoi(argv[2]);
+        add_stream(argv[1], atoi(argv[2]), NULL);
     }
     else {
         usage(argc, argv);
         return 1;
     }
 
-    if (!decoder_init()) {
-        return 2;
+    for (i = 0; i < g_stream_count; i++) {
+        struct stream_s *st = &g_streams[i];
+        st->decoder = (st->output != NULL) ? decoder_init_sink(st->output) : decoder_init();
+        if (st->decoder == NULL) {
+            errprint("%s: no output\n", st->name);
+            ret = 2;
+            goto _out;
+        }
+        decoders[i] = st->decoder;
+        names[i] = st->name;
     }
-    stream_video();
-    decoder_fini();
-    return 0;
+    if (getenv("DROIDCAM_STATS") != NULL) {
+        stats_start(getenv("DROIDCAM_STATS"), decoders, (g_stream_count > 1) ? names : NULL, g_stream_count);
+    }
+    if (trace_file != NULL) {
+        trace_open(trace_file);
+    }
+
+    connection_start();
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    v_running = 1;
+    if (g_replay != NULL) {
+        replay_video(g_streams[0].decoder);
+    } else if (g_stream_count == 1) {
+        stream_video(&g_streams[0]);
+    } else {
+        stream_all();
+    }
+    v_running = 0;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    if (connection_stopped()) {
+        errprint("stopped in %.1f ms\n", connection_stop_ms());
+    }
+    connection_cleanup();
+    stats_stop();
+    trace_close();
+
+_out:
+    for (i = 0; i < g_stream_count; i++) {
+        if (g_streams[i].decoder != NULL)
+            decoder_fini(g_streams[i].decoder);
+    }
+    bufpool_trim();
+    return ret;
 }
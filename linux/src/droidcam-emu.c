@@ -0,0 +1,561 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+/* Stands in for the phone: answers the video request the clients send,
+ * then streams JPEG frames at a fixed rate, either from a recorded corpus
+ * or generated. It can wait for the client like the app does, or connect
+ * to a client running in server mode. */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "jpeglib.h"
+
+#include "common.h"
+#include "decoder.h"
+
+typedef int SOCKET;
+#define INVALID_SOCKET -1
+
+#define SYNTH_FRAMES   30
+#define DEFAULT_PORT   4747
+
+struct emu_frame_s {
+ BYTE *data;
+ unsigned long length;
+};
+
+struct emu_stream_s {
+ SOCKET s;
+ int id;
+ unsigned frames;
+ unsigned late;
+ unsigned commands;
+ uint64_t bytes;
+};
+
+static struct emu_frame_s *frames;
+static int num_frames;
+static int width = 640, height = 480;
+static int fps = 30;
+static int kbps;
+static int quality = 80;
+static double seconds;
+static unsigned max_frames;
+static atomic_int streams;
+static volatile sig_atomic_t stopping;
+
+void ShowError(const char * title, const char * msg) {
+    errprint("%s: %s\n", title, msg);
+}
+
+static int send_all(SOCKET s, const void *buffer, unsigned long bytes) {
+    const char *ptr = (const char *)buffer;
+    ssize_t r;
+
+    while (bytes > 0) {
+        r = send(s, ptr, bytes, MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        ptr += r;
+        bytes -= r;
+    }
+    return 1;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stopping)
+        ;
+}
+
+/* Encodes an interleaved YCbCr image as a 4:2:0 JPEG, like the app sends */
+static unsigned long encode_frame(const BYTE *ycc, int w, int h, int q, BYTE **out) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned long len = 0;
+    JSAMPROW row;
+
+    *out = NULL;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, out, &len);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, q, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row = (JSAMPROW)(ycc + (size_t)cinfo.next_scanline * w * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return len;
+}
+
+/* Decodes a corpus frame to interleaved YCbCr, for re-encoding */
+static BYTE *decode_frame(const BYTE *jpg, unsigned long len, int *w, int *h) {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    BYTE *ycc;
+    JSAMPROW row;
+
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, (unsigned char *)jpg, len);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_YCbCr;
+    jpeg_start_decompress(&dinfo);
+    *w = dinfo.output_width;
+    *h = dinfo.output_height;
+
+    ycc = (BYTE*)malloc((size_t)*w * *h * 3);
+    while (ycc != NULL && dinfo.output_scanline < dinfo.output_height) {
+        row = ycc + (size_t)dinfo.output_scanline * *w * 3;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    return ycc;
+}
+
+/* Moving bars over a gradient, with a noisy patch so the frames cost
+ * about as many bits as camera pictures do */
+static void synth_image(BYTE *ycc, int w, int h, int n) {
+    int x, y, bar = (n * w / SYNTH_FRAMES) % w;
+    unsigned seed = 12345 + n;
+    BYTE *p = ycc;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            int Y = (x + y + n * 4) & 0xFF;
+            if (x >= bar && x < bar + w / 16) Y = 235;
+            if (x >= w / 4 && x < w / 2 && y >= h / 4 && y < h / 2) {
+                seed = seed * 1103515245 + 12345;
+                Y = 64 + ((seed >> 16) & 0x7F);
+            }
+            *p++ = Y;
+            *p++ = 128 + ((x * 64 / w) - 32);
+            *p++ = 128 + ((y * 64 / h) - 32);
+        }
+    }
+}
+
+/* The quality that gets the frame closest to, but not over, 'target' bytes */
+static int fit_quality(const BYTE *ycc, int w, int h, unsigned long target) {
+    int lo = 5, hi = 95, q;
+    unsigned long len;
+    BYTE *jpg;
+
+    while (lo < hi) {
+        q = (lo + hi + 1) / 2;
+        len = encode_frame(ycc, w, h, q, &jpg);
+        free(jpg);
+        if (len <= target) lo = q; else hi = q - 1;
+    }
+    return lo;
+}
+
+static int load_file(const char *path, BYTE **data, unsigned long *length) {
+    long size;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        errprint("%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    *data = (BYTE*)malloc(size);
+    *length = (unsigned long)size;
+    if (*data == NULL || fread(*data, 1, size, fp) != (size_t)size) {
+        errprint("%s: read failed\n", path);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Corpus frames are sent as recorded, unless a bitrate is asked for;
+ * then they are re-encoded at the quality that fits it. */
+static int load_corpus(int argc, char *argv[]) {
+    int i, w, h;
+    BYTE *ycc;
+
+    num_frames = argc;
+    frames = (struct emu_frame_s*)calloc(num_frames, sizeof(struct emu_frame_s));
+    for (i = 0; i < num_frames; i++) {
+        if (!load_file(argv[i], &frames[i].data, &frames[i].length))
+            return 0;
+
+        ycc = decode_frame(frames[i].data, frames[i].length, &w, &h);
+        if (ycc == NULL)
+            return 0;
+        if (i == 0) {
+            width = w;
+            height = h;
+        } else if (w != width || h != height) {
+            errprint("%s: %dx%d, the corpus is %dx%d\n", argv[i], w, h, width, height);
+            free(ycc);
+            return 0;
+        }
+        if (kbps > 0) {
+            if (i == 0)
+                quality = fit_quality(ycc, w, h, kbps * 1000UL / 8 / fps);
+            free(frames[i].data);
+            frames[i].length = encode_frame(ycc, w, h, quality, &frames[i].data);
+        }
+        free(ycc);
+    }
+    return 1;
+}
+
+static int make_synthetic(void) {
+    int i;
+    BYTE *ycc = (BYTE*)malloc((size_t)width * height * 3);
+
+    if (ycc == NULL)
+        return 0;
+    num_frames = SYNTH_FRAMES;
+    frames = (struct emu_frame_s*)calloc(num_frames, sizeof(struct emu_frame_s));
+    for (i = 0; i < num_frames; i++) {
+        synth_image(ycc, width, height, i);
+        if (i == 0 && kbps > 0)
+            quality = fit_quality(ycc, width, height, kbps * 1000UL / 8 / fps);
+        frames[i].length = encode_frame(ycc, width, height, quality, &frames[i].data);
+    }
+    free(ycc);
+    return 1;
+}
+
+/* Reads what the client sent without blocking for more than 'ms'.
+ * Returns the byte count, 0 if nothing came, -1 if the client is gone. */
+static int recv_request(SOCKET s, char *buf, int size, int ms) {
+    struct pollfd pfd = { .fd = s, .events = POLLIN };
+    int len = 0, r;
+
+    while (len < size - 1 && poll(&pfd, 1, ms) > 0) {
+        r = recv(s, buf + len, size - 1 - len, MSG_DONTWAIT);
+        if (r <= 0)
+            return (len > 0) ? len : -1;
+        len += r;
+        ms = 10;    // the rest of a request split over segments
+    }
+    buf[len] = 0;
+    return len;
+}
+
+/* Control commands arrive on the video socket between frames, possibly
+ * several in one read. Returns FALSE on a stop request. */
+static int handle_commands(struct emu_stream_s *st, char *buf) {
+    int code;
+    char *p = buf;
+
+    while ((p = strstr(p, "CMD ")) != NULL) {
+        if (sscanf(p, OTHER_REQ, &code) == 1) {
+            st->commands++;
+            errprint("[%d] control %d\n", st->id, code);
+        } else if (strncmp(p, STOP_REQ, CSTR_LEN(STOP_REQ)) == 0) {
+            return FALSE;
+        }
+        p += 4;
+    }
+    return TRUE;
+}
+
+static void stream_frames(struct emu_stream_s *st) {
+    char buf[256], header[4];
+    uint64_t start = now_us(), due = start, interval = 1000000 / fps, now;
+    struct emu_frame_s *f;
+    unsigned n;
+    int len;
+
+    for (n = 0; !stopping; n++) {
+        if (max_frames > 0 && n >= max_frames)
+            break;
+        if (seconds > 0 && now_us() - start >= (uint64_t)(seconds * 1e6))
+            break;
+
+        len = recv_request(st->s, buf, sizeof(buf), 0);
+        if (len < 0 || (len > 0 && !handle_commands(st, buf)))
+            break;
+
+        f = &frames[n % num_frames];
+        header[0] = f->length & 0xFF;
+        header[1] = (f->length >> 8) & 0xFF;
+        header[2] = (f->length >> 16) & 0xFF;
+        header[3] = (f->length >> 24) & 0xFF;
+        if (!send_all(st->s, header, 4) || !send_all(st->s, f->data, f->length))
+            break;
+        st->frames++;
+        st->bytes += 4 + f->length;
+
+        // keep to the frame clock; if sending fell a whole frame behind,
+        // start it over rather than bursting to catch up
+        due += interval;
+        now = now_us();
+        if (now > due + interval) {
+            st->late++;
+            due = now;
+        }
+        sleep_until(due);
+    }
+
+    now = now_us();
+    errprint("[%d] %u frames in %.1fs, %.1f fps, %.0f kbps, %u late, %u control\n",
+        st->id, st->frames, (now - start) / 1e6,
+        st->frames * 1e6 / (now - start + 1),
+        st->bytes * 8 / ((now - start + 1) / 1e3),
+        st->late, st->commands);
+}
+
+/* One client connection, from the request to the end of the stream */
+static void *serve_client(void *arg) {
+    struct emu_stream_s *st = (struct emu_stream_s *)arg;
+    char buf[64], header[5];
+    int len, w, h, code;
+    int one = 1;
+
+    setsockopt(st->s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    len = recv_request(st->s, buf, sizeof(buf), 5000);
+    if (len <= 0) {
+        errprint("[%d] no request\n", st->id);
+        goto _out;
+    }
+
+    if (sscanf(buf, VIDEO_REQ, &w, &h) == 2) {
+        errprint("[%d] video request %dx%d, streaming %dx%d at %d fps\n",
+            st->id, w, h, width, height, fps);
+        header[0] = (width >> 8) & 0xFF;
+        header[1] = width & 0xFF;
+        header[2] = (height >> 8) & 0xFF;
+        header[3] = height & 0xFF;
+        header[4] = FORMAT_C;
+        if (send_all(st->s, header, 5))
+            stream_frames(st);
+    } else if (sscanf(buf, OTHER_REQ, &code) == 1) {
+        errprint("[%d] control %d\n", st->id, code);
+    } else {
+        errprint("[%d] unknown request '%s'\n", st->id, buf);
+    }
+
+_out:
+    close(st->s);
+    free(st);
+    atomic_fetch_sub(&streams, 1);
+    return NULL;
+}
+
+static int start_stream(SOCKET s, int id, int detach) {
+    pthread_t thread;
+    struct emu_stream_s *st = (struct emu_stream_s*)calloc(1, sizeof(struct emu_stream_s));
+
+    if (st == NULL) {
+        close(s);
+        return 0;
+    }
+    st->s = s;
+    st->id = id;
+    atomic_fetch_add(&streams, 1);
+    if (!detach) {
+        serve_client(st);
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, serve_client, st) != 0) {
+        MSG_ERROR("Unable to start stream thread");
+        atomic_fetch_sub(&streams, 1);
+        close(s);
+        free(st);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+/* Like the app: wait for clients, each one gets a stream of its own */
+static int listen_clients(int port) {
+    struct sockaddr_in sin = {0};
+    int one = 1, id = 0;
+    SOCKET srv, s;
+
+    srv = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (srv == INVALID_SOCKET) {
+        MSG_LASTERROR("Could not create socket");
+        return 0;
+    }
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(port);
+    if (bind(srv, (struct sockaddr*)&sin, sizeof(sin)) < 0 || listen(srv, 16) < 0) {
+        MSG_LASTERROR("Error: bind");
+        close(srv);
+        return 0;
+    }
+
+    errprint("listening on port %d\n", port);
+    while (!stopping) {
+        s = accept(srv, NULL, NULL);
+        if (s == INVALID_SOCKET) {
+            if (errno == EINTR) continue;
+            MSG_LASTERROR("Accept Failed");
+            break;
+        }
+        start_stream(s, ++id, 1);
+    }
+    close(srv);
+    while (atomic_load(&streams) > 0)
+        usleep(10000);
+    return 1;
+}
+
+/* Server mode: the client is the one listening */
+static SOCKET connect_client(const char *ip, int port) {
+    struct sockaddr_in sin = {0};
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (s == INVALID_SOCKET) {
+        MSG_LASTERROR("Could not create socket");
+        return INVALID_SOCKET;
+    }
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ip);
+    sin.sin_port = htons(port);
+    if (connect(s, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        MSG_LASTERROR("Connect failed");
+        close(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static void on_signal(int sig) {
+    stopping = 1;
+}
+
+static void usage(char *argv[]) {
+    fprintf(stderr, "Usage: \n"
+    " %s [options] [frame.jpg ...]\n"
+    "   Act as the phone for droidcam clients, sending the given frames\n"
+    "   in a loop, or generated ones without any\n"
+    "\n"
+    "Options:\n"
+    " -l <port>       Wait for clients on 'port' (default %d)\n"
+    " -c <ip> <port>  Connect to a client listening with -l instead\n"
+    " -s <W>x<H>      Size of generated frames (default 640x480)\n"
+    " -f <fps>        Frame rate (default 30)\n"
+    " -b <kbps>       Encode the frames to about this bitrate\n"
+    " -q <quality>    JPEG quality of generated frames (default 80)\n"
+    " -t <seconds>    End each stream after 'seconds'\n"
+    " -n <frames>     End each stream after 'frames'\n"
+    ,
+    argv[0], DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    struct sigaction sa = {0};
+    char *ip = NULL;
+    int i, port = DEFAULT_PORT;
+    unsigned long total;
+    SOCKET s;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (argc > 3 && strcmp(argv[1], "-c") == 0) {
+            ip = argv[2];
+            port = atoi(argv[3]);
+            argv += 3; argc -= 3;
+            continue;
+        }
+        if (argc < 3) {
+            usage(argv);
+            return 1;
+        }
+        if (strcmp(argv[1], "-l") == 0) {
+            port = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-s") == 0) {
+            if (sscanf(argv[2], "%dx%d", &width, &height) != 2) width = 0;
+        } else if (strcmp(argv[1], "-f") == 0) {
+            fps = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-b") == 0) {
+            kbps = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-q") == 0) {
+            quality = atoi(argv[2]);
+        } else if (strcmp(argv[1], "-t") == 0) {
+            seconds = atof(argv[2]);
+        } else if (strcmp(argv[1], "-n") == 0) {
+            max_frames = atoi(argv[2]);
+        } else {
+            usage(argv);
+            return 1;
+        }
+        argv += 2; argc -= 2;
+    }
+
+    // the decoders expect whole 4:2:0 MCUs
+    if (fps < 1 || port < 1 || quality < 1 || quality > 100
+        || width < 16 || height < 16 || width % 16 != 0 || height % 16 != 0) {
+        usage(argv);
+        return 1;
+    }
+
+    if (argc > 1) {
+        if (!load_corpus(argc - 1, argv + 1))
+            return 1;
+        if (width % 16 != 0 || height % 16 != 0)
+            errprint("warning: %dx%d is not in whole MCUs\n", width, height);
+    } else if (!make_synthetic()) {
+        return 1;
+    }
+
+    for (i = 0, total = 0; i < num_frames; i++)
+        total += frames[i].length;
+    errprint("%d frames of %dx%d, %lu bytes on average\n", num_frames, width, height, total / num_frames);
+
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (ip == NULL)
+        return listen_clients(port) ? 0 : 2;
+
+    s = connect_client(ip, port);
+    if (s == INVALID_SOCKET)
+        return 2;
+    start_stream(s, 1, 0);
+    return 0;
+}
@@ -7,6 +7,7 @@
  * Use at your own risk. See README file for more details.
  */
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,7 @@
 #include "connection.h"
 #include "decoder.h"
 #include "icon.h"
+#include "trace.h"
 
 enum callbacks {
 	CB_BUTTON = 0,
@@ -52,10 +54,10 @@ struct settings {
 /* Globals */
 GtkWidget *menu;
 GThread* hVideoThread;
-int v_running = 0;
-int thread_cmd = 0;
+atomic_int v_running = 0;
 int wifi_srvr_mode = 0;
 struct settings g_settings = {0};
+struct decoder_s *g_decoder;
 
 extern int m_width, m_height, m_format;
 
@@ -181,10 +183,10 @@ static void LoadSaveSettings(int load) {
 void * VideoThreadProc(void * args)
 {
 	char buf[32];
+	struct recv_buf_s rb = {0};
 	SOCKET videoSocket = (SOCKET) args;
 	int keep_waiting = 0;
 	dbgprint("Video Thread Started s=%d\n", videoSocket);
-	v_running = 1;
 
 server_wait:
 	if (videoSocket == INVALID_SOCKET) {
@@ -194,7 +196,7 @@ server_wait:
 	}
 
 	{
-		int len = snprintf(buf, sizeof(buf), VIDEO_REQ, decoder_get_video_width(), decoder_get_video_height());
+		int len = snprintf(buf, sizeof(buf), VIDEO_REQ, decoder_get_video_width(g_decoder), decoder_get_video_height(g_decoder));
 		if (SendRecv(1, buf, len, videoSocket) <= 0){
 			MSG_ERROR("Error sending request, DroidCam might be busy with another client.");
 			goto early_out;
@@ -207,35 +209,19 @@ server_wait:
 		goto early_out;
 	}
 
-	if (decoder_prepare_video(buf) == FALSE) {
+	if (decoder_prepare_video(g_decoder, buf) == FALSE || !recv_buf_init(&rb, videoSocket)) {
 		goto early_out;
 	}
 
 	while (v_running != 0){
-		if (thread_cmd != 0) {
-			int len = sprintf(buf, OTHER_REQ, thread_cmd);
-			SendRecv(1, buf, len, videoSocket);
-			thread_cmd = 0;
-		}
-
-		int frameLen;
-		struct jpg_frame_s *f = decoder_get_next_frame();
-		if (SendRecv(0, buf, 4, videoSocket) == FALSE) break;
-		make_int4(frameLen, buf[0], buf[1], buf[2], buf[3]);
-		f->length = frameLen;
-		char *p = (char*)f->data;
-		while (frameLen > 4096) {
-			if (SendRecv(0, p, 4096, videoSocket) == FALSE) goto early_out;
-			frameLen -= 4096;
-			p += 4096;
-		}
-		if (SendRecv(0, p, frameLen, videoSocket) == FALSE) break;
+		if (recv_video_frame(g_decoder, &rb) == FALSE) break;
 	}
 
 early_out:
 	dbgprint("disconnect\n");
+	recv_buf_fini(&rb);
 	disconnect(videoSocket);
-	decoder_cleanup();
+	decoder_cleanup(g_decoder);
 
 	if (v_running && keep_waiting){
 		videoSocket = INVALID_SOCKET;
@@ -254,11 +240,12 @@ early_out:
 static void StopVideo()
 {
 	v_running = 0;
+	connection_stop();
 	if (hVideoThread != NULL)
 	{
 		dbgprint("Waiting for videothread..\n");
 		g_thread_join(hVideoThread);
-		dbgprint("videothread joined\n");
+		dbgprint("videothread joined, %.1f ms after the stop\n", connection_stop_ms());
 		hVideoThread = NULL;
 		//gtk_widget_set_sensitive(GTK_WIDGET(g_settings.button), TRUE);
 	}
@@ -284,8 +271,8 @@ accel_callback( GtkAccelGroup  *group,
 		  GdkModifierType mod,
 		  gpointer		user_data)
 {
-	if(v_running == 1 && thread_cmd ==0){
-		thread_cmd = (int) user_data;
+	if(v_running == 1){
+		connection_control((int) user_data);
 	}
 	return TRUE;
 }
@@ -315,6 +302,7 @@ _up:
 				SOCKET s = INVALID_SOCKET;
 				int port = atoi(gtk_entry_get_text(g_settings.portEntry));
 				LoadSaveSettings(0); // Save
+				connection_start();
 
 				if (g_settings.connection == CB_RADIO_ADB) {
 					if (CheckAdbDevices(port) != 8) return;
@@ -340,6 +328,8 @@ _up:
 					}
 				}
 
+				// set before the thread starts, so a stop can't be missed
+				v_running = 1;
 				hVideoThread = g_thread_create(VideoThreadProc, (void*)s, TRUE, NULL);
 				gtk_button_set_label(g_settings.button, "Stop");
 				//gtk_widget_set_sensitive(GTK_WIDGET(g_settings.button), FALSE);
@@ -347,7 +337,7 @@ _up:
 				gtk_widget_set_sensitive(GTK_WIDGET(g_settings.ipEntry), FALSE);
 				gtk_widget_set_sensitive(GTK_WIDGET(g_settings.portEntry), FALSE);
 #else
-				decoder_show_test_image();
+				decoder_show_test_image(g_decoder);
 #endif
 			}
 		break;
@@ -384,8 +374,8 @@ _up:
 		case CB_CONTROL_ZOUT :
 		case CB_CONTROL_AF   :
 		case CB_CONTROL_LED  :
-		if(v_running == 1 && thread_cmd ==0){
-			thread_cmd =  cb - 10;
+		if(v_running == 1){
+			connection_control(cb - 10);
 		}
 		break;
 		case CB_AUDIO:
@@ -407,12 +397,14 @@ int main(int argc, char *argv[])
 	GtkWidget *hbox, *hbox2;
 	GtkWidget *vbox;
 	GtkWidget *widget; // generic stuff
+	const char *trace_file;
 
 	// init threads
 	g_thread_init(NULL);
 	gdk_threads_init();
 	gtk_init(&argc, &argv);
 	memset(&g_settings, 0, sizeof(struct settings));
+	trace_file = trace_option(&argc, argv);
 
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(window), "DroidCam Client");
@@ -544,15 +536,17 @@ int main(int argc, char *argv[])
 	gtk_widget_show_all(window);
 
 	LoadSaveSettings(1); // Load
-	if ( decoder_init() )
+	if ( (g_decoder = decoder_init()) != NULL )
 	{
+		if (trace_file != NULL) trace_open(trace_file);
 		gdk_threads_enter();
 		gtk_main();
 		gdk_threads_leave();
 
 		if (v_running == 1) StopVideo();
 
-		decoder_fini();
+		trace_close();
+		decoder_fini(g_decoder);
 		connection_cleanup();
 	}
 
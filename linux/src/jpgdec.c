@@ -0,0 +1,405 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "jpgdec.h"
+#include "jerror.h"
+
+#define FREE_OBJECT(obj, free_func) if(obj){dbgprint(" " #obj " %p\n", obj); free_func(obj); obj=NULL;}
+
+static void joutput_message(j_common_ptr cinfo) {
+    char buffer[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message) (cinfo, buffer);
+    dbgprint("JERR: %s", buffer);
+}
+
+static void jerror_exit(j_common_ptr cinfo) {
+    dbgprint("jerror_exit(), fatal error");
+    ((struct jpgdec_s *)cinfo)->fatal_error = 1;
+    (*cinfo->err->output_message) (cinfo);
+}
+
+/* Source manager over a frame that may still be arriving. Bytes past
+ * 'avail' are only handed to libjpeg once wait() reports them received;
+ * if it returns without progress the frame was cut short, and a fake EOI
+ * lets libjpeg finish with what it has, like jpeg_mem_src() does. */
+static const JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+
+static void src_init(j_decompress_ptr cinfo) {
+}
+
+static boolean src_fill(j_decompress_ptr cinfo) {
+    struct jpgdec_src_s *src = (struct jpgdec_src_s *)cinfo->src;
+    unsigned long have = src->avail;
+
+    if (have < src->length && src->wait != NULL)
+        have = src->wait(src->arg, have);
+
+    if (have > src->avail) {
+        src->pub.next_input_byte = src->data + src->avail;
+        src->pub.bytes_in_buffer = have - src->avail;
+        src->avail = have;
+    } else {
+        WARNMS(cinfo, JWRN_JPEG_EOF);
+        src->pub.next_input_byte = fake_eoi;
+        src->pub.bytes_in_buffer = 2;
+    }
+    return TRUE;
+}
+
+static void src_skip(j_decompress_ptr cinfo, long num_bytes) {
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    if (num_bytes <= 0)
+        return;
+    while (num_bytes > (long)src->bytes_in_buffer) {
+        num_bytes -= (long)src->bytes_in_buffer;
+        src_fill(cinfo);
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+}
+
+static void src_term(j_decompress_ptr cinfo) {
+}
+
+static void src_set(struct jpgdec_s *dec, BYTE *p, unsigned long len, unsigned long have,
+                    jpgdec_wait_fn wait, void *arg) {
+    dec->src.data = p;
+    dec->src.length = len;
+    dec->src.avail = have;
+    dec->src.wait = wait;
+    dec->src.arg = arg;
+    dec->src.pub.next_input_byte = p;
+    dec->src.pub.bytes_in_buffer = have;
+}
+
+const char *jpgdec_backend_name(int backend) {
+    return (backend == JPGDEC_TURBOJPEG) ? "turbojpeg" : "libjpeg";
+}
+
+int jpgdec_backend_from_name(const char *name) {
+    if (name != NULL && strcmp(name, "libjpeg") == 0)
+        return JPGDEC_LIBJPEG;
+    return JPGDEC_TURBOJPEG;
+}
+
+/* The libjpeg context is always created since it is the fallback
+ * for frames that turbojpeg refuses, and for when it fails to load */
+int jpgdec_init(struct jpgdec_s *dec, int backend) {
+    memset(dec, 0, sizeof(struct jpgdec_s));
+    dec->dinfo.err = jpeg_std_error(&dec->jerr);
+    dec->jerr.output_message = joutput_message;
+    dec->jerr.error_exit = jerror_exit;
+    jpeg_create_decompress(&dec->dinfo);
+    if (dec->fatal_error) return 0;
+    dec->init = 1;
+    dec->src.pub.init_source = src_init;
+    dec->src.pub.fill_input_buffer = src_fill;
+    dec->src.pub.skip_input_data = src_skip;
+    dec->src.pub.resync_to_restart = jpeg_resync_to_restart;
+    dec->src.pub.term_source = src_term;
+    dec->dinfo.src = &dec->src.pub;
+    dec->scale_denom = 1;
+
+    dec->backend = JPGDEC_LIBJPEG;
+    if (backend == JPGDEC_TURBOJPEG) {
+        dec->tj = tjInitDecompress();
+        if (dec->tj != NULL) {
+            dec->backend = JPGDEC_TURBOJPEG;
+        } else {
+            errprint("turbojpeg init failed, using libjpeg\n");
+        }
+    }
+    dbgprint("jpeg backend: %s\n", jpgdec_backend_name(dec->backend));
+    return 1;
+}
+
+void jpgdec_reset(struct jpgdec_s *dec) {
+    int i;
+    for (i = 0; i < MAX_COMPONENTS; i++) {
+        FREE_OBJECT(dec->outbuf[i], free);
+    }
+    FREE_OBJECT(dec->chroma_tmp, free);
+    dec->outbuf_base = NULL;
+}
+
+/* Decode at 1/denom of the stream resolution, with denom one of 1, 2, 4
+ * or 8. Both backends do this in the IDCT, skipping most of its work. */
+void jpgdec_set_scale(struct jpgdec_s *dec, int denom) {
+    if (denom != 2 && denom != 4 && denom != 8)
+        denom = 1;
+    if (denom != dec->scale_denom) {
+        /* chroma_tmp is sized for the output, start over */
+        FREE_OBJECT(dec->chroma_tmp, free);
+        dec->outbuf_base = NULL;
+    }
+    dec->scale_denom = denom;
+}
+
+void jpgdec_fini(struct jpgdec_s *dec) {
+    jpgdec_reset(dec);
+    FREE_OBJECT(dec->tj, tjDestroy);
+    FREE_OBJECT(dec->tjx, tjDestroy);
+    FREE_OBJECT(dec->xform_buf, tjFree);
+    dec->xform_size = 0;
+    if (dec->init != 0) {
+        jpeg_destroy_decompress(&dec->dinfo);
+        dec->init = 0;
+    }
+    dec->fatal_error = 0;
+}
+
+static int is_yuv420(struct jpeg_decompress_struct *dinfo) {
+    return dinfo->num_components == 3
+        && dinfo->comp_info[0].h_samp_factor == 2 && dinfo->comp_info[0].v_samp_factor == 2
+        && dinfo->comp_info[1].h_samp_factor == 1 && dinfo->comp_info[1].v_samp_factor == 1
+        && dinfo->comp_info[2].h_samp_factor == 1 && dinfo->comp_info[2].v_samp_factor == 1;
+}
+
+/* libjpeg may pick a larger IDCT for chroma than for luma when scaling,
+ * to save upsampling work. In raw mode that hands us chroma at the scaled
+ * luma resolution, so those rows go to chroma_tmp and get subsampled. */
+#if JPEG_LIB_VERSION >= 70
+#define MIN_DCT_SCALED(d) ((d)->min_DCT_v_scaled_size)
+#define DCT_SCALED(c)     ((c)->DCT_v_scaled_size)
+#else
+#define MIN_DCT_SCALED(d) ((d)->min_DCT_scaled_size)
+#define DCT_SCALED(c)     ((c)->DCT_scaled_size)
+#endif
+
+static int setup_outbuf(struct jpgdec_s *dec, BYTE *yuv420) {
+    struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+    int i, row;
+    int w = dinfo->output_width, h = dinfo->output_height;
+    BYTE *ptr = yuv420;
+    BYTE *tmp;
+
+    dec->chroma_up = DCT_SCALED(&dinfo->comp_info[1]) / MIN_DCT_SCALED(dinfo);
+    if (dec->chroma_up > 1 && dec->chroma_tmp == NULL) {
+        if ((dec->chroma_tmp = (BYTE*)malloc(w * h * 2)) == NULL) {
+            errprint("error: malloc failure\n");
+            return 0;
+        }
+    }
+    tmp = dec->chroma_tmp;
+
+    for (i = 0; i < dinfo->num_components; i++) {
+        jpeg_component_info *compptr = &dinfo->comp_info[i];
+        int up = (i == 0) ? 1 : dec->chroma_up;
+        int cw = w * compptr->h_samp_factor * up / dinfo->max_h_samp_factor;
+        dec->ch[i] = h * compptr->v_samp_factor * up / dinfo->max_v_samp_factor;
+
+        dbgprint("extra alloc: %d\n", (int)(sizeof(JSAMPROW)*dec->ch[i]));
+        if ((dec->outbuf[i] = (JSAMPROW *)realloc(dec->outbuf[i], sizeof(JSAMPROW)*dec->ch[i])) == NULL) {
+            errprint("error: malloc failure\n");
+            return 0;
+        }
+        for (row = 0; row < dec->ch[i]; row++) {
+            if (up > 1) {
+                dec->outbuf[i][row] = tmp;
+                tmp += cw;
+            } else {
+                dec->outbuf[i][row] = ptr;
+                ptr += cw;
+            }
+        }
+        if (up > 1)
+            ptr += (w / 2) * (h / 2);
+    }
+    dec->outbuf_base = yuv420;
+    dec->outbuf_scale = dec->scale_denom;
+    return 1;
+}
+
+static void subsample_chroma(struct jpgdec_s *dec, BYTE *yuv420, int w, int h) {
+    int c, x, y;
+    BYTE *src = dec->chroma_tmp;
+    BYTE *dst = yuv420 + w * h;
+
+    for (c = 0; c < 2; c++) {
+        for (y = 0; y < h; y += 2) {
+            BYTE *s0 = src + y * w;
+            BYTE *s1 = s0 + w;
+            for (x = 0; x < w; x += 2) {
+                *dst++ = (s0[x] + s0[x+1] + s1[x] + s1[x+1] + 2) >> 2;
+            }
+        }
+        src += w * h;
+    }
+}
+
+static int decode_libjpeg(struct jpgdec_s *dec, BYTE *yuv420, int width, int height) {
+    struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+    int i, row, rows_per_imcu;
+
+    dec->fatal_error = 0;
+    jpeg_read_header(dinfo, TRUE);
+    if (dec->fatal_error) goto _abort;
+    dinfo->raw_data_out = TRUE;
+    dinfo->do_fancy_upsampling = FALSE;
+    dinfo->dct_method = JDCT_FASTEST;
+    dinfo->out_color_space = JCS_YCbCr;
+    dinfo->scale_num = 1;
+    dinfo->scale_denom = dec->scale_denom;
+
+    if (!is_yuv420(dinfo)) {
+        errprint("Error: Unexpected video image stream subsampling\n");
+        goto _abort;
+    }
+
+    if ((int)dinfo->image_width != width || (int)dinfo->image_height != height
+        || (width % (DCTSIZE*2)) != 0 || (height % (DCTSIZE*2)) != 0) {
+        errprint("error: Unexpected video image dimensions\n");
+        goto _abort;
+    }
+
+    jpeg_start_decompress(dinfo);
+    if (dec->fatal_error) goto _abort;
+
+    if ((int)dinfo->output_width != width / dec->scale_denom || (int)dinfo->output_height != height / dec->scale_denom) {
+        dbgprint("error: decoder output %dx%d differs from expected %dx%d size\n",
+            dinfo->output_width, dinfo->output_height, width / dec->scale_denom, height / dec->scale_denom);
+        goto _abort;
+    }
+
+    if ((dec->outbuf_base != yuv420 || dec->outbuf_scale != dec->scale_denom) && !setup_outbuf(dec, yuv420))
+        goto _abort;
+
+    rows_per_imcu = dinfo->max_v_samp_factor * MIN_DCT_SCALED(dinfo);
+    for (row = 0; row < (int)dinfo->output_height; row += rows_per_imcu) {
+        JSAMPARRAY yuvptr[MAX_COMPONENTS];
+        for (i = 0; i < dinfo->num_components; i++) {
+            jpeg_component_info *compptr = &dinfo->comp_info[i];
+            yuvptr[i] = &dec->outbuf[i][row / rows_per_imcu * compptr->v_samp_factor * DCT_SCALED(compptr)];
+        }
+        jpeg_read_raw_data(dinfo, yuvptr, rows_per_imcu);
+        if (dec->fatal_error) goto _abort;
+    }
+    jpeg_finish_decompress(dinfo);
+
+    if (dec->chroma_up > 1)
+        subsample_chroma(dec, yuv420, dinfo->output_width, dinfo->output_height);
+    return 1;
+
+_abort:
+    jpeg_abort_decompress(dinfo);
+    return 0;
+}
+
+static int decode_turbojpeg(struct jpgdec_s *dec, BYTE *p, unsigned long len, BYTE *yuv420, int width, int height) {
+    int w, h, subsamp, colorspace;
+    BYTE *planes[3];
+    int strides[3];
+
+    if (tjDecompressHeader3(dec->tj, p, len, &w, &h, &subsamp, &colorspace) < 0) {
+        dbgprint("tjDecompressHeader3: %s\n", tjGetErrorStr2(dec->tj));
+        return 0;
+    }
+    if (subsamp != TJSAMP_420) {
+        errprint("Error: Unexpected video image stream subsampling\n");
+        return 0;
+    }
+    if (w != width || h != height) {
+        dbgprint("error: decoder output %dx%d differs from expected %dx%d size\n", w, h, width, height);
+        return 0;
+    }
+
+    width /= dec->scale_denom;
+    height /= dec->scale_denom;
+    planes[0] = yuv420;
+    planes[1] = planes[0] + width * height;
+    planes[2] = planes[1] + width * height / 4;
+    strides[0] = width;
+    strides[1] = strides[2] = width / 2;
+
+    if (tjDecompressToYUVPlanes(dec->tj, p, len, planes, width, strides, height, TJFLAG_FASTDCT) < 0) {
+        dbgprint("tjDecompressToYUVPlanes: %s\n", tjGetErrorStr2(dec->tj));
+        return 0;
+    }
+    return 1;
+}
+
+/* Decodes one width x height frame into 'yuv420' at 1/scale_denom of that
+ * size; the buffer must hold width*height*3/2 bytes.
+ * Frames turbojpeg rejects are retried with libjpeg, which is more lenient
+ * with truncated frames on older turbojpeg versions. */
+int jpgdec_decode(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, BYTE *yuv420, int width, int height) {
+    if (dec->backend == JPGDEC_TURBOJPEG) {
+        if (decode_turbojpeg(dec, jpg, len, yuv420, width, height))
+            return 1;
+        dbgprint("turbojpeg decode failed, retrying with libjpeg\n");
+    }
+    src_set(dec, jpg, len, len, NULL, NULL);
+    return decode_libjpeg(dec, yuv420, width, height);
+}
+
+/* Like jpgdec_decode(), for a frame of which only the first 'have' bytes
+ * have arrived. wait(arg, have) must block until more than 'have' bytes
+ * are there and return the new count, or return 'have' to give up.
+ * Huffman decoding and IMCU row output run as the data comes in, so this
+ * always uses libjpeg. */
+int jpgdec_decode_stream(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, unsigned long have,
+                         jpgdec_wait_fn wait, void *arg, BYTE *yuv420, int width, int height) {
+    src_set(dec, jpg, len, have, wait, arg);
+    return decode_libjpeg(dec, yuv420, width, height);
+}
+
+/* Lossless rotation by 'degrees' clockwise (90, 180 or 270), done like
+ * jpegtran does it, by moving DCT coefficient blocks around instead of
+ * decoding. Only whole MCUs can be moved, so the frame must be a multiple
+ * of 16 in both directions. *out is valid until the next call. */
+int jpgdec_rotate(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, int degrees,
+                  BYTE **out, unsigned long *out_len) {
+    int w, h, subsamp, colorspace;
+    unsigned long size;
+    tjtransform xform;
+
+    if (dec->tjx == NULL) {
+        dec->tjx = tjInitTransform();
+        if (dec->tjx == NULL) {
+            errprint("turbojpeg transform init failed\n");
+            return 0;
+        }
+    }
+
+    if (tjDecompressHeader3(dec->tjx, jpg, len, &w, &h, &subsamp, &colorspace) < 0) {
+        dbgprint("tjDecompressHeader3: %s\n", tjGetErrorStr2(dec->tjx));
+        return 0;
+    }
+    if (subsamp != TJSAMP_420 || w % 16 != 0 || h % 16 != 0) {
+        dbgprint("cannot rotate a %dx%d frame losslessly\n", w, h);
+        return 0;
+    }
+
+    size = tjBufSize(w, h, subsamp);
+    if (size > dec->xform_size) {
+        FREE_OBJECT(dec->xform_buf, tjFree);
+        dec->xform_size = 0;
+        dec->xform_buf = tjAlloc(size);
+        if (dec->xform_buf == NULL)
+            return 0;
+        dec->xform_size = size;
+    }
+
+    memset(&xform, 0, sizeof(xform));
+    xform.op = (degrees == 90) ? TJXOP_ROT90 : (degrees == 180) ? TJXOP_ROT180 : TJXOP_ROT270;
+    xform.options = TJXOPT_PERFECT;
+    *out = dec->xform_buf;
+    *out_len = dec->xform_size;
+    if (tjTransform(dec->tjx, jpg, len, 1, out, out_len, &xform, TJFLAG_NOREALLOC) < 0) {
+        dbgprint("tjTransform: %s\n", tjGetErrorStr2(dec->tjx));
+        return 0;
+    }
+    return 1;
+}
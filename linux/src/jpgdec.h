@@ -0,0 +1,76 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __JPGDEC_H__
+#define __JPGDEC_H__
+
+#include <stdio.h>
+#include "jpeglib.h"
+#include "turbojpeg.h"
+
+typedef unsigned char BYTE;
+
+#define JPGDEC_LIBJPEG   0
+#define JPGDEC_TURBOJPEG 1
+
+typedef unsigned long (*jpgdec_wait_fn)(void *arg, unsigned long have);
+
+struct jpgdec_src_s {
+ struct jpeg_source_mgr pub;
+ BYTE *data;
+ unsigned long length;
+ unsigned long avail;
+ jpgdec_wait_fn wait;
+ void *arg;
+};
+
+/* JPEG -> planar YUV420 decoder. The stream from the app is always 4:2:0
+ * with dimensions in whole MCUs, so both backends write the Y, U and V
+ * planes back to back into one buffer without padding. */
+struct jpgdec_s {
+ struct jpeg_decompress_struct dinfo;   /* must stay first, see jerror_exit() */
+ struct jpeg_error_mgr jerr;
+ int fatal_error;
+ int init;
+
+ struct jpgdec_src_s src;
+
+ tjhandle tj;
+ int backend;
+
+ /* lossless rotation, see jpgdec_rotate() */
+ tjhandle tjx;
+ BYTE *xform_buf;
+ unsigned long xform_size;
+
+ int scale_denom;
+
+ /* libjpeg raw output row tables; allocated on the first frame and
+  * re-pointed whenever the output buffer or scale changes */
+ int ch[MAX_COMPONENTS];
+ JSAMPROW *outbuf[MAX_COMPONENTS];
+ BYTE *outbuf_base;
+ int outbuf_scale;
+ int chroma_up;
+ BYTE *chroma_tmp;
+};
+
+int  jpgdec_init(struct jpgdec_s *dec, int backend);
+void jpgdec_fini(struct jpgdec_s *dec);
+void jpgdec_reset(struct jpgdec_s *dec);
+void jpgdec_set_scale(struct jpgdec_s *dec, int denom);
+int  jpgdec_decode(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, BYTE *yuv420, int width, int height);
+int  jpgdec_decode_stream(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, unsigned long have,
+                          jpgdec_wait_fn wait, void *arg, BYTE *yuv420, int width, int height);
+int  jpgdec_rotate(struct jpgdec_s *dec, BYTE *jpg, unsigned long len, int degrees,
+                   BYTE **out, unsigned long *out_len);
+int  jpgdec_backend_from_name(const char *name);
+const char *jpgdec_backend_name(int backend);
+
+#endif
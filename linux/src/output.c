@@ -0,0 +1,359 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "output.h"
+
+static int xioctl(int fd, int request, void *arg){
+    int r;
+    do r = ioctl (fd, request, arg);
+    while (-1 == r && EINTR == errno);
+    return r;
+}
+
+/* /dev/videoN taken by an open output, so a scan skips devices that were
+ * already given to another stream of the process */
+#define MAX_VIDEO_DEV 99
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+static char claimed[MAX_VIDEO_DEV];
+
+int output_sink_from_name(const char *name, const char **arg) {
+    *arg = NULL;
+    if (name == NULL || strcmp(name, "v4l2") == 0)
+        return OUTPUT_V4L2_MMAP;
+    if (strncmp(name, "/dev/", 5) == 0) {
+        *arg = name;
+        return OUTPUT_V4L2_MMAP;
+    }
+    if (strcmp(name, "v4l2-write") == 0)
+        return OUTPUT_V4L2_WRITE;
+    if (strcmp(name, "null") == 0)
+        return OUTPUT_NULL;
+    if (strncmp(name, "file:", 5) == 0 && name[5] != 0) {
+        *arg = name + 5;
+        return OUTPUT_FILE;
+    }
+    errprint("unknown output '%s', using v4l2\n", name);
+    return OUTPUT_V4L2_MMAP;
+}
+
+const char *output_sink_name(int sink) {
+    switch (sink) {
+    case OUTPUT_V4L2_WRITE: return "v4l2-write";
+    case OUTPUT_V4L2_MMAP:  return "v4l2";
+    case OUTPUT_FILE:       return "file";
+    }
+    return "null";
+}
+
+/* Opens 'device' if it is a Droidcam loopback device */
+static int open_droidcam_v4l(struct output_s *o, const char *device) {
+    struct stat st;
+    struct v4l2_capability v4l2cap;
+
+    o->fd = -1;
+    if(-1 == stat(device, &st) || !S_ISCHR(st.st_mode)){
+        return 0;
+    }
+
+    o->fd = open(device, O_RDWR | O_NONBLOCK, 0);
+
+    if(-1 == o->fd) {
+        printf("Error opening '%s': %d '%s'\n", device, errno, strerror(errno));
+        return 0;
+    }
+    if(-1 == xioctl(o->fd, VIDIOC_QUERYCAP, &v4l2cap)) {
+        close(o->fd);
+        o->fd = -1;
+        return 0;
+    }
+    printf("Device: %s\n", v4l2cap.card);
+    if(0 == strncmp((const char*) v4l2cap.card, "Droidcam", 8)) {
+        printf("Found driver: %s (fd:%d)\n", device, o->fd);
+        return 1;
+    }
+    close(o->fd); // not DroidCam
+    o->fd = -1;
+    return 0;
+}
+
+/* 'want' is the device to use, or NULL for the first Droidcam device that
+ * no other output has */
+static int find_droidcam_v4l(struct output_s *o, const char *want){
+    int crt_video_dev;
+    int want_dev = -1, n = 0;
+    char device[16];
+    int found = 0;
+
+    o->devnum = -1;
+    pthread_mutex_lock(&claim_lock);
+    if (want != NULL) {
+        // only a plain /dev/videoN is claimed, a symlink can't be told apart
+        if (sscanf(want, "/dev/video%d%n", &want_dev, &n) != 1 || want[n] != '\0'
+            || want_dev < 0 || want_dev >= MAX_VIDEO_DEV)
+            want_dev = -1;
+        if (want_dev >= 0 && claimed[want_dev]) {
+            errprint("%s is already in use\n", want);
+        } else if (open_droidcam_v4l(o, want)) {
+            found = 1;
+            if (want_dev >= 0) {
+                claimed[want_dev] = 1;
+                o->devnum = want_dev;
+            }
+        } else {
+            errprint("%s is not a Droidcam device\n", want);
+        }
+    } else {
+        for(crt_video_dev = 0; crt_video_dev < MAX_VIDEO_DEV; crt_video_dev++) {
+            if (claimed[crt_video_dev])
+                continue;
+            snprintf(device, sizeof(device), "/dev/video%d", crt_video_dev);
+            if (open_droidcam_v4l(o, device)) {
+                found = 1;
+                claimed[crt_video_dev] = 1;
+                o->devnum = crt_video_dev;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&claim_lock);
+
+    if (!found && want == NULL)
+        MSG_ERROR("Device not found (/dev/video[0-9]).\nDid you install it?\n");
+    return found;
+}
+
+static void query_droidcam_v4l(struct output_s *o) {
+    struct v4l2_format vid_format = {0};
+    vid_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vid_format.fmt.pix.width = 0;
+    vid_format.fmt.pix.height = 0;
+    if (xioctl(o->fd, VIDIOC_G_FMT, &vid_format) < 0) {
+        fprintf(stderr, "Fatal: Unable to query droidcam video device. errno=%d\n", errno);
+        return;
+    }
+
+    dbgprint("  vid_format->type                =%d\n", vid_format.type );
+    dbgprint("  vid_format->fmt.pix.width       =%d\n", vid_format.fmt.pix.width );
+    dbgprint("  vid_format->fmt.pix.height      =%d\n", vid_format.fmt.pix.height );
+    dbgprint("  vid_format->fmt.pix.pixelformat =%d\n", vid_format.fmt.pix.pixelformat);
+    dbgprint("  vid_format->fmt.pix.sizeimage   =%d\n", vid_format.fmt.pix.sizeimage );
+    dbgprint("  vid_format->fmt.pix.field       =%d\n", vid_format.fmt.pix.field );
+    dbgprint("  vid_format->fmt.pix.bytesperline=%d\n", vid_format.fmt.pix.bytesperline );
+    dbgprint("  vid_format->fmt.pix.colorspace  =%d\n", vid_format.fmt.pix.colorspace );
+    if (vid_format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420) {
+        fprintf(stderr, "Fatal: droidcam video device reported pixel format %d, expected %d\n",
+            vid_format.fmt.pix.pixelformat, V4L2_PIX_FMT_YUV420);
+        return;
+    }
+    if (vid_format.fmt.pix.width <= 0 ||  vid_format.fmt.pix.height <= 0) {
+        fprintf(stderr, "Fatal: droidcam video device reported invalid resolution: %dx%d\n",
+            vid_format.fmt.pix.width, vid_format.fmt.pix.height);
+        return;
+    }
+
+    o->width = vid_format.fmt.pix.width;
+    o->height = vid_format.fmt.pix.height;
+}
+
+static void v4l_mmap_fini(struct output_s *o) {
+    int i;
+    struct v4l2_requestbuffers req = {0};
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+    if (o->count == 0)
+        return;
+
+    xioctl(o->fd, VIDIOC_STREAMOFF, &type);
+    for (i = 0; i < o->count; i++) {
+        munmap(o->start[i], o->length[i]);
+    }
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count = 0;
+    xioctl(o->fd, VIDIOC_REQBUFS, &req);
+    o->count = 0;
+}
+
+static int v4l_mmap_init(struct output_s *o) {
+    unsigned i;
+    struct v4l2_requestbuffers req = {0};
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+    o->count = 0;
+    o->index = -1;
+
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count = OUTPUT_MMAP_BUFFERS;
+    if (xioctl(o->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 1) {
+        dbgprint("VIDIOC_REQBUFS failed, errno=%d\n", errno);
+        return 0;
+    }
+    if (req.count > OUTPUT_MMAP_BUFFERS)
+        req.count = OUTPUT_MMAP_BUFFERS;
+
+    for (i = 0; i < req.count; i++) {
+        struct v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(o->fd, VIDIOC_QUERYBUF, &buf) < 0 || buf.length < o->frame_size)
+            goto _error_out;
+
+        o->start[i] = (BYTE*)mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+            o->fd, buf.m.offset);
+        if (o->start[i] == MAP_FAILED)
+            goto _error_out;
+        o->length[i] = buf.length;
+        o->count++;
+    }
+
+    if (xioctl(o->fd, VIDIOC_STREAMON, &type) < 0)
+        goto _error_out;
+
+    dbgprint("v4l2 output: %d mmap buffers\n", o->count);
+    return 1;
+
+_error_out:
+    dbgprint("v4l2 mmap setup failed, errno=%d; using write()\n", errno);
+    v4l_mmap_fini(o);
+    return 0;
+}
+
+int output_open(struct output_s *o, int sink, const char *arg, int width, int height) {
+    const char *env = getenv("DROIDCAM_OUTPUT_MMAP");
+
+    memset(o, 0, sizeof(struct output_s));
+    o->fd = -1;
+    o->index = -1;
+    o->devnum = -1;
+    o->sink = sink;
+    o->width = width;
+    o->height = height;
+
+    switch (sink) {
+    case OUTPUT_V4L2_MMAP:
+    case OUTPUT_V4L2_WRITE:
+        o->width = o->height = 0;
+        if (!find_droidcam_v4l(o, arg))
+            return 0;
+        query_droidcam_v4l(o);
+        break;
+    case OUTPUT_FILE:
+        o->fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (o->fd < 0) {
+            MSG_LASTERROR("Error: output file");
+            return 0;
+        }
+        break;
+    }
+
+    dbgprint("output %s: %dx%d\n", output_sink_name(o->sink), o->width, o->height);
+    if (o->width < 2 || o->height < 2 || o->width > 9999 || o->height > 9999){
+        MSG_ERROR("Unable to query droidcam device for parameters");
+        output_close(o);
+        return 0;
+    }
+    o->frame_size = o->width * o->height * 3 / 2;
+
+    if (o->sink == OUTPUT_V4L2_MMAP && ((env != NULL && atoi(env) == 0) || !v4l_mmap_init(o)))
+        o->sink = OUTPUT_V4L2_WRITE;
+    return 1;
+}
+
+void output_close(struct output_s *o) {
+    v4l_mmap_fini(o);
+    if (o->fd >= 0) close(o->fd);
+    o->fd = -1;
+    if (o->devnum >= 0) {
+        pthread_mutex_lock(&claim_lock);
+        claimed[o->devnum] = 0;
+        pthread_mutex_unlock(&claim_lock);
+        o->devnum = -1;
+    }
+}
+
+BYTE *output_buffer(struct output_s *o) {
+    if (o->sink == OUTPUT_V4L2_MMAP && o->count > 0) {
+        struct v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(o->fd, VIDIOC_DQBUF, &buf) == 0 && (int)buf.index < o->count) {
+            o->index = buf.index;
+            return o->start[buf.index];
+        }
+        errprint("VIDIOC_DQBUF failed (errno=%d), falling back to write()\n", errno);
+        v4l_mmap_fini(o);
+        o->sink = OUTPUT_V4L2_WRITE;
+    }
+    return NULL;
+}
+
+/* The whole frame, or 0 on an error */
+static int write_all(int fd, const BYTE *p, unsigned size) {
+    ssize_t r;
+
+    while (size > 0) {
+        r = write(fd, p, size);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            if (r == 0) errno = EIO;
+            return 0;
+        }
+        p += r;
+        size -= r;
+    }
+    return 1;
+}
+
+void output_frame(struct output_s *o, BYTE *p, uint64_t ts) {
+    switch (o->sink) {
+    case OUTPUT_V4L2_MMAP:
+        if (o->index >= 0 && p == o->start[o->index]) {
+            struct v4l2_buffer buf = {0};
+            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = o->index;
+            buf.bytesused = o->frame_size;
+            buf.field = V4L2_FIELD_NONE;
+            if (ts != 0) {
+                buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+                buf.timestamp.tv_sec = ts / 1000000;
+                buf.timestamp.tv_usec = ts % 1000000;
+            }
+            o->index = -1;
+            if (xioctl(o->fd, VIDIOC_QBUF, &buf) < 0)
+                errprint("VIDIOC_QBUF failed, errno=%d\n", errno);
+            break;
+        }
+        // fall through, the frame was not made in a device buffer
+    case OUTPUT_V4L2_WRITE:
+    case OUTPUT_FILE:
+        // a part of a frame would shift every later one in a file
+        if (!write_all(o->fd, p, o->frame_size)) {
+            errprint("%s output failed (errno=%d), dropping the frames\n", output_sink_name(o->sink), errno);
+            o->sink = OUTPUT_NULL;
+        }
+        break;
+    }
+}
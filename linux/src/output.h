@@ -0,0 +1,59 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned char BYTE;
+
+/* Where the finished YUV420 frames go. The V4L2 sinks need the
+ * v4l2loopback-dc module; the others let the pipeline run without it. */
+#define OUTPUT_V4L2_WRITE 0     /* write() to the loopback device */
+#define OUTPUT_V4L2_MMAP  1     /* mmap'ed OUTPUT buffers, else write() */
+#define OUTPUT_FILE       2     /* raw frames appended to a file */
+#define OUTPUT_NULL       3     /* discarded */
+
+#define OUTPUT_MMAP_BUFFERS 16
+
+struct output_s {
+ int sink;
+ int fd;
+ int devnum;            /* N of the /dev/videoN it holds, or -1 */
+ int width, height;
+ unsigned frame_size;
+
+ /* Loopback buffers mapped for V4L2 OUTPUT streaming. While they are
+  * set up the last pipeline stage writes straight into a dequeued buffer
+  * and the frame is handed over with VIDIOC_QBUF instead of write(). */
+ int count;
+ int index;
+ BYTE *start[OUTPUT_MMAP_BUFFERS];
+ size_t length[OUTPUT_MMAP_BUFFERS];
+};
+
+/* "v4l2", "v4l2-write", "null", "file:PATH" or a /dev/videoN path for
+ * that loopback device; 'arg' gets the path */
+int  output_sink_from_name(const char *name, const char **arg);
+const char *output_sink_name(int sink);
+
+/* The V4L2 sinks take the frame size from the device, the others use
+ * width x height. 'arg' is the path for OUTPUT_FILE, and for the V4L2
+ * sinks the device to use, or NULL for the first one no other output has. */
+int  output_open(struct output_s *o, int sink, const char *arg, int width, int height);
+void output_close(struct output_s *o);
+
+/* The buffer the next frame should be produced in, or NULL for any */
+BYTE *output_buffer(struct output_s *o);
+/* Hands over a frame; 'ts' is the time it started to arrive, or 0 */
+void output_frame(struct output_s *o, BYTE *p, uint64_t ts);
+
+#endif
@@ -0,0 +1,311 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "connection.h"
+#include "decoder.h"
+#include "stats.h"
+
+/* The server thread only reads the counters the decoder and connection
+ * code keep, so the frame path takes no locks for it. Once a second it
+ * samples them to work out the rates. */
+struct stats_stream_s {
+ struct decoder_s *decoder;
+ char label[48];        /* stream="name", or empty for a lone stream */
+ struct decoder_stats_s st;
+
+ unsigned last_in, last_out;
+ uint64_t last_bytes;
+ double fps_in, fps_out, bytes_per_sec;
+};
+
+struct stats_server_s {
+ int fd;
+ int wake[2];
+ char path[108];
+ pthread_t thread;
+ int started;
+
+ struct stats_stream_s streams[STATS_MAX_STREAMS];
+ int count;
+ struct timespec last_sample;
+
+ char buf[65536];
+ int len;
+};
+
+static struct stats_server_s server = { .fd = -1 };
+
+static const char *stage_names[STATS_STAGES] = {
+    "receive", "decode", "transform", "write",
+};
+
+static void out(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (server.len >= (int)sizeof(server.buf))
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(server.buf + server.len, sizeof(server.buf) - server.len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        server.len += n;
+}
+
+static void sample(void) {
+    struct decoder_stats_s st;
+    struct timespec now;
+    double dt;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = (now.tv_sec - server.last_sample.tv_sec) + (now.tv_nsec - server.last_sample.tv_nsec) / 1e9;
+    for (i = 0; i < server.count; i++) {
+        struct stats_stream_s *ss = &server.streams[i];
+        decoder_get_stats(ss->decoder, &st);
+        if (server.last_sample.tv_sec != 0 && dt > 0) {
+            ss->fps_in = (st.frames_in - ss->last_in) / dt;
+            ss->fps_out = (st.frames_out - ss->last_out) / dt;
+            ss->bytes_per_sec = (st.bytes_in - ss->last_bytes) / dt;
+        }
+        ss->last_in = st.frames_in;
+        ss->last_out = st.frames_out;
+        ss->last_bytes = st.bytes_in;
+    }
+    server.last_sample = now;
+}
+
+/* 'label' is empty or a list of name="value" pairs for every series */
+static void histogram(const char *name, const char *label, const unsigned *hist,
+                      unsigned base, double unit, uint64_t sum) {
+    int i;
+    unsigned count = 0;
+    const char *sep = label[0] ? "," : "";
+
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+        count += hist[i];
+        out("%s_bucket{%s%sle=\"%.10g\"} %u\n", name, label, sep, ((uint64_t)base << i) * unit, count);
+    }
+    count += hist[i];
+    out("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, label, sep, count);
+    if (label[0]) {
+        out("%s_sum{%s} %.10g\n%s_count{%s} %u\n", name, label, sum * unit, name, label, count);
+    } else {
+        out("%s_sum %.10g\n%s_count %u\n", name, sum * unit, name, count);
+    }
+}
+
+/* One line per stream of a counter or gauge */
+#define SERIES(name, fmt, value) do { \
+    for (i = 0; i < server.count; i++) { \
+        struct stats_stream_s *ss = &server.streams[i]; \
+        if (ss->label[0]) out(name "{%s} " fmt "\n", ss->label, value); \
+        else out(name " " fmt "\n", value); \
+    } \
+} while (0)
+
+static void render(void) {
+    char label[80];
+    int i, j;
+
+    for (i = 0; i < server.count; i++)
+        decoder_get_stats(server.streams[i].decoder, &server.streams[i].st);
+    server.len = 0;
+
+    out("# HELP droidcam_frames_in_total Frames received from the phone.\n"
+        "# TYPE droidcam_frames_in_total counter\n");
+    SERIES("droidcam_frames_in_total", "%u", ss->st.frames_in);
+    out("# HELP droidcam_frames_out_total Frames written to the loopback device.\n"
+        "# TYPE droidcam_frames_out_total counter\n");
+    SERIES("droidcam_frames_out_total", "%u", ss->st.frames_out);
+    out("# HELP droidcam_frames_dropped_total Frames dropped before decoding.\n"
+        "# TYPE droidcam_frames_dropped_total counter\n");
+    SERIES("droidcam_frames_dropped_total", "%u", ss->st.dropped);
+    out("# HELP droidcam_received_bytes_total JPEG bytes received.\n"
+        "# TYPE droidcam_received_bytes_total counter\n");
+    SERIES("droidcam_received_bytes_total", "%llu", (unsigned long long)ss->st.bytes_in);
+    out("# HELP droidcam_connections_total Connections to the phone, the first one included.\n"
+        "# TYPE droidcam_connections_total counter\n"
+        "droidcam_connections_total %u\n", connection_count());
+
+    out("# HELP droidcam_fps_in Frames received per second.\n"
+        "# TYPE droidcam_fps_in gauge\n");
+    SERIES("droidcam_fps_in", "%.2f", ss->fps_in);
+    out("# HELP droidcam_fps_out Frames written per second.\n"
+        "# TYPE droidcam_fps_out gauge\n");
+    SERIES("droidcam_fps_out", "%.2f", ss->fps_out);
+    out("# HELP droidcam_received_bytes_per_second JPEG bytes received per second.\n"
+        "# TYPE droidcam_received_bytes_per_second gauge\n");
+    SERIES("droidcam_received_bytes_per_second", "%.0f", ss->bytes_per_sec);
+    out("# HELP droidcam_buffered_frames Frames waiting to be decoded.\n"
+        "# TYPE droidcam_buffered_frames gauge\n");
+    SERIES("droidcam_buffered_frames", "%u", ss->st.buffered);
+
+    out("# HELP droidcam_frame_bytes Size of the received JPEG frames.\n"
+        "# TYPE droidcam_frame_bytes histogram\n");
+    for (i = 0; i < server.count; i++) {
+        struct stats_stream_s *ss = &server.streams[i];
+        histogram("droidcam_frame_bytes", ss->label, ss->st.size_hist, STATS_SIZE_BASE, 1, ss->st.bytes_in);
+    }
+
+    out("# HELP droidcam_stage_seconds Time spent per frame in each pipeline stage.\n"
+        "# TYPE droidcam_stage_seconds histogram\n");
+    for (i = 0; i < server.count; i++) {
+        struct stats_stream_s *ss = &server.streams[i];
+        for (j = 0; j < STATS_STAGES; j++) {
+            snprintf(label, sizeof(label), "%s%sstage=\"%s\"", ss->label, ss->label[0] ? "," : "", stage_names[j]);
+            histogram("droidcam_stage_seconds", label, ss->st.stage_hist[j], STATS_TIME_BASE, 1e-6, ss->st.stage_sum[j]);
+        }
+    }
+}
+
+static void serve(int client) {
+    struct pollfd pfd = { .fd = client, .events = POLLIN };
+    char header[128], req[512];
+    int n;
+
+    // HTTP clients send a request first; a plain socket reader may not
+    if (poll(&pfd, 1, 100) > 0)
+        recv(client, req, sizeof(req), MSG_DONTWAIT);
+
+    render();
+    n = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n\r\n", server.len);
+    send(client, header, n, MSG_NOSIGNAL);
+    send(client, server.buf, server.len, MSG_NOSIGNAL);
+    close(client);
+}
+
+static void *stats_thread_proc(void *args) {
+    struct pollfd pfd[2];
+    struct timespec now;
+    int client;
+
+    pfd[0].fd = server.fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = server.wake[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec != server.last_sample.tv_sec)
+            sample();
+
+        if (pfd[0].revents & POLLIN) {
+            client = accept(server.fd, NULL, NULL);
+            if (client >= 0)
+                serve(client);
+        }
+    }
+    return 0;
+}
+
+int stats_start(const char *addr, struct decoder_s **d, const char **names, int count) {
+    int i;
+
+    if (count > STATS_MAX_STREAMS)
+        count = STATS_MAX_STREAMS;
+    for (i = 0; i < count; i++) {
+        server.streams[i].decoder = d[i];
+        server.streams[i].label[0] = 0;
+        if (names != NULL)
+            snprintf(server.streams[i].label, sizeof(server.streams[i].label), "stream=\"%s\"", names[i]);
+    }
+    server.count = count;
+    if (addr[0] == '/') {
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof(sa.sun_path)) {
+            errprint("stats socket path too long: %s\n", addr);
+            return FALSE;
+        }
+        strcpy(sa.sun_path, addr);
+        unlink(addr);
+        server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server.fd < 0 || bind(server.fd, (struct sockaddr*)&sa, sizeof(sa)) < 0)
+            goto _error_out;
+        strcpy(server.path, addr);
+    } else {
+        int on = 1;
+        struct sockaddr_in sin = { .sin_family = AF_INET };
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(atoi(addr));
+        server.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server.fd < 0)
+            goto _error_out;
+        setsockopt(server.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(server.fd, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+            goto _error_out;
+    }
+
+    if (listen(server.fd, 4) < 0 || pipe(server.wake) < 0)
+        goto _error_out;
+    if (pthread_create(&server.thread, NULL, stats_thread_proc, NULL) != 0) {
+        close(server.wake[0]);
+        close(server.wake[1]);
+        goto _error_out;
+    }
+    pthread_setname_np(server.thread, "stats");
+    server.started = 1;
+    errprint("stats on %s\n", addr);
+    return TRUE;
+
+_error_out:
+    MSG_LASTERROR("Error: stats socket");
+    if (server.fd >= 0) close(server.fd);
+    server.fd = -1;
+    if (server.path[0]) unlink(server.path);
+    server.path[0] = 0;
+    return FALSE;
+}
+
+void stats_stop(void) {
+    if (!server.started)
+        return;
+
+    if (write(server.wake[1], "", 1) < 0) {
+        MSG_LASTERROR("Error: pipe");
+        // the hangup wakes it all the same
+        close(server.wake[1]);
+        server.wake[1] = -1;
+    }
+    pthread_join(server.thread, NULL);
+    close(server.wake[0]);
+    if (server.wake[1] >= 0) close(server.wake[1]);
+    close(server.fd);
+    server.fd = -1;
+    if (server.path[0]) unlink(server.path);
+    server.path[0] = 0;
+    server.started = 0;
+}
@@ -0,0 +1,24 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+struct decoder_s;
+
+#define STATS_MAX_STREAMS 16
+
+/* Serve the counters of the 'count' decoders 'd' and of the connections as
+ * Prometheus text over HTTP, on the Unix socket 'addr' if it is a path, or
+ * on 127.0.0.1 port 'addr' otherwise. With 'names' every series gets a
+ * stream="name" label; without, there should be one decoder. */
+int  stats_start(const char *addr, struct decoder_s **d, const char **names, int count);
+void stats_stop(void);
+
+#endif
@@ -0,0 +1,202 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_RING_EVENTS 8192
+#define TRACE_FLUSH_MS    100
+
+struct trace_event_s {
+ const char *name;
+ uint64_t ts, dur;
+};
+
+/* Single producer (the owning thread), single consumer (the flusher) */
+struct trace_ring_s {
+ struct trace_event_s ev[TRACE_RING_EVENTS];
+ atomic_uint head;
+ atomic_uint tail;
+ atomic_uint dropped;
+ int tid;
+ char name[16];
+ int named;                 /* thread_name event written */
+ struct trace_ring_s *next;
+};
+
+struct trace_s {
+ FILE *fp;
+ atomic_int on;
+ atomic_int running;
+ int events;                /* written so far, for the commas */
+ pthread_t thread;
+ pthread_mutex_t lock;      /* the list of rings, taken once per thread */
+ struct trace_ring_s *rings;
+};
+
+static struct trace_s trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread struct trace_ring_s *thread_ring;
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct trace_ring_s *trace_ring(void) {
+    struct trace_ring_s *ring = calloc(1, sizeof(struct trace_ring_s));
+    if (ring == NULL)
+        return NULL;
+
+    ring->tid = (int)syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+    pthread_mutex_lock(&trace.lock);
+    ring->next = trace.rings;
+    trace.rings = ring;
+    pthread_mutex_unlock(&trace.lock);
+    return ring;
+}
+
+uint64_t trace_begin(void) {
+    if (!atomic_load_explicit(&trace.on, memory_order_relaxed))
+        return 0;
+    return trace_now();
+}
+
+void trace_end(const char *name, uint64_t start) {
+    struct trace_ring_s *ring = thread_ring;
+    struct trace_event_s *e;
+    unsigned head;
+
+    if (start == 0 || !atomic_load_explicit(&trace.on, memory_order_relaxed))
+        return;
+    if (ring == NULL && (ring = thread_ring = trace_ring()) == NULL)
+        return;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_EVENTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    e = &ring->ev[head % TRACE_RING_EVENTS];
+    e->name = name;
+    e->ts = start;
+    e->dur = trace_now() - start;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void trace_write(const char *fmt, const char *name, int tid, uint64_t ts, uint64_t dur) {
+    fputs(trace.events++ ? ",\n" : "[\n", trace.fp);
+    fprintf(trace.fp, fmt, name, (int)getpid(), tid, (unsigned long long)ts, (unsigned long long)dur);
+}
+
+static void trace_flush(void) {
+    struct trace_ring_s *ring;
+    struct trace_event_s *e;
+    unsigned head, tail;
+
+    pthread_mutex_lock(&trace.lock);
+    for (ring = trace.rings; ring != NULL; ring = ring->next) {
+        if (!ring->named && ring->name[0]) {
+            trace_write("{\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":\"%s\"},"
+                "\"pid\":%d,\"tid\":%d}", ring->name, ring->tid, 0, 0);
+            ring->named = 1;
+        }
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            e = &ring->ev[tail % TRACE_RING_EVENTS];
+            trace_write("{\"name\":\"%s\",\"cat\":\"droidcam\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%llu,\"dur\":%llu}", e->name, ring->tid, e->ts, e->dur);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&trace.lock);
+    fflush(trace.fp);
+}
+
+static void *trace_thread_proc(void *args) {
+    struct timespec ts = { 0, TRACE_FLUSH_MS * 1000000 };
+
+    while (atomic_load_explicit(&trace.running, memory_order_acquire)) {
+        nanosleep(&ts, NULL);
+        trace_flush();
+    }
+    return 0;
+}
+
+const char *trace_option(int *argc, char *argv[]) {
+    int i;
+    const char *path;
+
+    for (i = 1; i + 1 < *argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            path = argv[i + 1];
+            memmove(&argv[i], &argv[i + 2], (*argc - i - 1) * sizeof(char*));
+            *argc -= 2;
+            return path;
+        }
+    }
+    return NULL;
+}
+
+int trace_open(const char *path) {
+    trace.fp = fopen(path, "w");
+    if (trace.fp == NULL) {
+        MSG_LASTERROR("Error: trace file");
+        return FALSE;
+    }
+    trace.events = 0;
+    atomic_store(&trace.running, 1);
+    if (pthread_create(&trace.thread, NULL, trace_thread_proc, NULL) != 0) {
+        MSG_ERROR("Unable to start trace thread");
+        fclose(trace.fp);
+        trace.fp = NULL;
+        return FALSE;
+    }
+    pthread_setname_np(trace.thread, "trace");
+    atomic_store(&trace.on, 1);
+    return TRUE;
+}
+
+void trace_close(void) {
+    struct trace_ring_s *ring;
+    unsigned dropped = 0;
+
+    if (trace.fp == NULL)
+        return;
+
+    atomic_store(&trace.on, 0);
+    atomic_store_explicit(&trace.running, 0, memory_order_release);
+    pthread_join(trace.thread, NULL);
+    trace_flush();
+    fputs(trace.events ? "\n]\n" : "[]\n", trace.fp);
+    fclose(trace.fp);
+    trace.fp = NULL;
+
+    while ((ring = trace.rings) != NULL) {
+        dropped += atomic_load(&ring->dropped);
+        trace.rings = ring->next;
+        free(ring);
+    }
+    thread_ring = NULL;
+    if (dropped)
+        errprint("trace: %u events dropped, the rings were full\n", dropped);
+}
@@ -0,0 +1,36 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Chrome/Perfetto trace-event export. Every thread records its spans in
+ * a preallocated ring of its own; a background thread drains the rings
+ * into the JSON file, so recording a span is a handful of stores.
+ *
+ *   uint64_t t = trace_begin();
+ *   ...
+ *   trace_end("decode", t);
+ *
+ * Span names must be string literals. trace_begin() returns 0 and
+ * trace_end() does nothing while tracing is off. */
+
+/* Removes "--trace FILE" from the arguments and returns FILE, or NULL */
+const char *trace_option(int *argc, char *argv[]);
+
+int  trace_open(const char *path);
+/* Only once the threads that record spans are done */
+void trace_close(void);
+
+uint64_t trace_begin(void);
+void     trace_end(const char *name, uint64_t start);
+
+#endif
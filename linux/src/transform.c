@@ -0,0 +1,487 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transform.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSFORM_X86 1
+#include <immintrin.h>
+#endif
+
+/* 90/270 degree rotations walk the source in TILE x TILE squares so that
+ * both the rows being read and the columns being written stay in cache. */
+#define TILE 64
+
+static int simd_level = -1;
+
+static int detect_simd(void) {
+#ifdef TRANSFORM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return TRANSFORM_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return TRANSFORM_SIMD_SSE2;
+#endif
+    return TRANSFORM_SIMD_NONE;
+}
+
+int transform_simd_level(void) {
+    if (simd_level < 0)
+        simd_level = detect_simd();
+    return simd_level;
+}
+
+/* Limit the kernels to 'level', mostly for benchmarking */
+void transform_set_simd_level(int level) {
+    int max = detect_simd();
+    simd_level = (level < 0 || level > max) ? max : level;
+}
+
+const char *transform_simd_name(int level) {
+    switch (level) {
+        case TRANSFORM_SIMD_AVX2: return "avx2";
+        case TRANSFORM_SIMD_SSE2: return "sse2";
+    }
+    return "c";
+}
+
+/* Transpose kernels: read 'n' rows of 8 pixels starting at s, stepping by
+ * sstep, and write them as 8 rows of 'n' pixels starting at d, stepping by
+ * dstep. Negative steps give the flips that turn a transpose into a
+ * rotation. */
+static void transpose_8xn_c(const BYTE *s, int sstep, BYTE *d, int dstep, int n) {
+    int i, j;
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < n; i++)
+            d[i] = s[i * sstep + j];
+        d += dstep;
+    }
+}
+
+#ifdef TRANSFORM_X86
+__attribute__((target("sse2")))
+static void transpose_8x8_sse2(const BYTE *s, int sstep, BYTE *d, int dstep) {
+    __m128i a0 = _mm_loadl_epi64((const __m128i *)(s + 0 * sstep));
+    __m128i a1 = _mm_loadl_epi64((const __m128i *)(s + 1 * sstep));
+    __m128i a2 = _mm_loadl_epi64((const __m128i *)(s + 2 * sstep));
+    __m128i a3 = _mm_loadl_epi64((const __m128i *)(s + 3 * sstep));
+    __m128i a4 = _mm_loadl_epi64((const __m128i *)(s + 4 * sstep));
+    __m128i a5 = _mm_loadl_epi64((const __m128i *)(s + 5 * sstep));
+    __m128i a6 = _mm_loadl_epi64((const __m128i *)(s + 6 * sstep));
+    __m128i a7 = _mm_loadl_epi64((const __m128i *)(s + 7 * sstep));
+
+    __m128i b0 = _mm_unpacklo_epi8(a0, a1);
+    __m128i b1 = _mm_unpacklo_epi8(a2, a3);
+    __m128i b2 = _mm_unpacklo_epi8(a4, a5);
+    __m128i b3 = _mm_unpacklo_epi8(a6, a7);
+
+    __m128i c0 = _mm_unpacklo_epi16(b0, b1);
+    __m128i c1 = _mm_unpackhi_epi16(b0, b1);
+    __m128i c2 = _mm_unpacklo_epi16(b2, b3);
+    __m128i c3 = _mm_unpackhi_epi16(b2, b3);
+
+    // each of these holds two output rows
+    __m128i d0 = _mm_unpacklo_epi32(c0, c2);
+    __m128i d1 = _mm_unpackhi_epi32(c0, c2);
+    __m128i d2 = _mm_unpacklo_epi32(c1, c3);
+    __m128i d3 = _mm_unpackhi_epi32(c1, c3);
+
+    _mm_storel_epi64((__m128i *)(d + 0 * dstep), d0);
+    _mm_storel_epi64((__m128i *)(d + 1 * dstep), _mm_unpackhi_epi64(d0, d0));
+    _mm_storel_epi64((__m128i *)(d + 2 * dstep), d1);
+    _mm_storel_epi64((__m128i *)(d + 3 * dstep), _mm_unpackhi_epi64(d1, d1));
+    _mm_storel_epi64((__m128i *)(d + 4 * dstep), d2);
+    _mm_storel_epi64((__m128i *)(d + 5 * dstep), _mm_unpackhi_epi64(d2, d2));
+    _mm_storel_epi64((__m128i *)(d + 6 * dstep), d3);
+    _mm_storel_epi64((__m128i *)(d + 7 * dstep), _mm_unpackhi_epi64(d3, d3));
+}
+
+/* Same as above on 16 rows: rows k and k+8 share a register, one per
+ * 128-bit lane, and the lanes are merged before the stores. */
+__attribute__((target("avx2")))
+static void transpose_8x16_avx2(const BYTE *s, int sstep, BYTE *d, int dstep) {
+    __m256i a[8], b[4], c[4], e[4];
+    int k;
+
+    for (k = 0; k < 8; k++) {
+        __m128i lo = _mm_loadl_epi64((const __m128i *)(s + k * sstep));
+        __m128i hi = _mm_loadl_epi64((const __m128i *)(s + (k + 8) * sstep));
+        a[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    }
+
+    b[0] = _mm256_unpacklo_epi8(a[0], a[1]);
+    b[1] = _mm256_unpacklo_epi8(a[2], a[3]);
+    b[2] = _mm256_unpacklo_epi8(a[4], a[5]);
+    b[3] = _mm256_unpacklo_epi8(a[6], a[7]);
+
+    c[0] = _mm256_unpacklo_epi16(b[0], b[1]);
+    c[1] = _mm256_unpackhi_epi16(b[0], b[1]);
+    c[2] = _mm256_unpacklo_epi16(b[2], b[3]);
+    c[3] = _mm256_unpackhi_epi16(b[2], b[3]);
+
+    e[0] = _mm256_unpacklo_epi32(c[0], c[2]);
+    e[1] = _mm256_unpackhi_epi32(c[0], c[2]);
+    e[2] = _mm256_unpacklo_epi32(c[1], c[3]);
+    e[3] = _mm256_unpackhi_epi32(c[1], c[3]);
+
+    for (k = 0; k < 4; k++) {
+        // [row 2k rows 0-7 | row 2k+1 rows 0-7 | row 2k rows 8-15 | ...]
+        __m256i r = _mm256_permute4x64_epi64(e[k], 0xD8);
+        _mm_storeu_si128((__m128i *)(d + (2 * k) * dstep), _mm256_castsi256_si128(r));
+        _mm_storeu_si128((__m128i *)(d + (2 * k + 1) * dstep), _mm256_extracti128_si256(r, 1));
+    }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i reverse_sse2(__m128i v) {
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static int reverse_row_sse2(const BYTE *s, BYTE *d, int w) {
+    int x;
+    for (x = 0; x + 16 <= w; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + x));
+        _mm_storeu_si128((__m128i *)(d + w - 16 - x), reverse_sse2(v));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int reverse_row_avx2(const BYTE *s, BYTE *d, int w) {
+    int x;
+    const __m256i rev = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    for (x = 0; x + 32 <= w; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + x));
+        v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, rev), _MM_SHUFFLE(1, 0, 3, 2));
+        _mm256_storeu_si256((__m256i *)(d + w - 32 - x), v);
+    }
+    return x;
+}
+#endif
+
+/* One block of rows [y, y + n) and columns [x, x + 8) */
+static inline void rotate_block(const BYTE *src, int w, int h, int sstride,
+                                BYTE *dst, int dstride, int x, int y, int n, int cw, int level)
+{
+    const BYTE *s;
+    BYTE *d;
+    int sstep, dstep;
+
+    if (cw) {
+        // dst(r, c) = src(h - 1 - c, r): read bottom up, rows stay in order
+        s = src + (y + n - 1) * sstride + x;
+        sstep = -sstride;
+        d = dst + x * dstride + (h - n - y);
+        dstep = dstride;
+    } else {
+        // dst(r, c) = src(c, w - 1 - r): read top down, rows come out reversed
+        s = src + y * sstride + x;
+        sstep = sstride;
+        d = dst + (w - 1 - x) * dstride + y;
+        dstep = -dstride;
+    }
+
+#ifdef TRANSFORM_X86
+    if (n == 16 && level >= TRANSFORM_SIMD_AVX2) {
+        transpose_8x16_avx2(s, sstep, d, dstep);
+        return;
+    }
+    if (n == 8 && level >= TRANSFORM_SIMD_SSE2) {
+        transpose_8x8_sse2(s, sstep, d, dstep);
+        return;
+    }
+#endif
+    transpose_8xn_c(s, sstep, d, dstep, n);
+}
+
+static void rotate_edge(const BYTE *src, int w, int h, int sstride, BYTE *dst, int dstride,
+                        int x0, int x1, int y0, int y1, int cw)
+{
+    int x, y;
+    for (y = y0; y < y1; y++) {
+        const BYTE *s = src + y * sstride;
+        if (cw) {
+            for (x = x0; x < x1; x++)
+                dst[x * dstride + (h - 1 - y)] = s[x];
+        } else {
+            for (x = x0; x < x1; x++)
+                dst[(w - 1 - x) * dstride + y] = s[x];
+        }
+    }
+}
+
+static void rotate90_plane(const BYTE *src, int w, int h, int sstride, BYTE *dst, int dstride, int cw) {
+    int level = transform_simd_level();
+    int n = (level >= TRANSFORM_SIMD_AVX2) ? 16 : 8;
+    int wb = w & ~7;
+    int hb = h - h % n;
+    int tx, ty, x, y;
+
+    for (ty = 0; ty < hb; ty += TILE) {
+        int ty1 = (ty + TILE < hb) ? ty + TILE : hb;
+        for (tx = 0; tx < wb; tx += TILE) {
+            int tx1 = (tx + TILE < wb) ? tx + TILE : wb;
+            for (y = ty; y < ty1; y += n) {
+                for (x = tx; x < tx1; x += 8)
+                    rotate_block(src, w, h, sstride, dst, dstride, x, y, n, cw, level);
+            }
+        }
+    }
+
+    rotate_edge(src, w, h, sstride, dst, dstride, wb, w, 0, h, cw);
+    rotate_edge(src, w, h, sstride, dst, dstride, 0, wb, hb, h, cw);
+}
+
+static void rotate180_plane(const BYTE *src, int w, int h, int sstride, BYTE *dst, int dstride) {
+    int level = transform_simd_level();
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        const BYTE *s = src + y * sstride;
+        BYTE *d = dst + (h - 1 - y) * dstride;
+        x = 0;
+#ifdef TRANSFORM_X86
+        if (level >= TRANSFORM_SIMD_AVX2)
+            x = reverse_row_avx2(s, d, w);
+        else if (level >= TRANSFORM_SIMD_SSE2)
+            x = reverse_row_sse2(s, d, w);
+#endif
+        for (; x < w; x++)
+            d[w - 1 - x] = s[x];
+    }
+}
+
+void transform_rotate_plane(const BYTE *src, int w, int h, int sstride,
+                            BYTE *dst, int dstride, int angle)
+{
+    switch (angle) {
+        case TRANSFORM_ROT90:
+            rotate90_plane(src, w, h, sstride, dst, dstride, 0);
+            break;
+        case TRANSFORM_ROT180:
+            rotate180_plane(src, w, h, sstride, dst, dstride);
+            break;
+        case TRANSFORM_ROT270:
+            rotate90_plane(src, w, h, sstride, dst, dstride, 1);
+            break;
+        default:
+            for (; h > 0; h--, src += sstride, dst += dstride)
+                memcpy(dst, src, w);
+    }
+}
+
+/* Fill everything outside the x, y, w, h rectangle */
+static void fill_border(BYTE *p, int stride, int dw, int dh, int x, int y, int w, int h, BYTE value) {
+    int row;
+    if (y > 0)
+        memset(p, value, y * stride);
+    if (y + h < dh)
+        memset(p + (y + h) * stride, value, (dh - y - h) * stride);
+    if (w >= dw)
+        return;
+    for (row = y; row < y + h; row++) {
+        memset(p + row * stride, value, x);
+        memset(p + row * stride + x + w, value, dw - x - w);
+    }
+}
+
+int transform_rotate_yuv420(const BYTE *src, int w, int h, BYTE *dst, int dw, int dh, int angle) {
+    int rw = w, rh = h;
+    int x, y, i;
+    const BYTE *s = src;
+    BYTE *d = dst;
+
+    if (angle == TRANSFORM_ROT90 || angle == TRANSFORM_ROT270) {
+        rw = h;
+        rh = w;
+    }
+    if (rw > dw || rh > dh || (w | h | dw | dh) & 1)
+        return 0;
+
+    // keep the offsets even so the chroma planes line up
+    x = ((dw - rw) / 2) & ~1;
+    y = ((dh - rh) / 2) & ~1;
+
+    for (i = 0; i < 3; i++) {
+        int sh = (i == 0) ? 0 : 1;
+        int pw = w >> sh, ph = h >> sh, ds = dw >> sh;
+        fill_border(d, ds, ds, dh >> sh, x >> sh, y >> sh, rw >> sh, rh >> sh, (i == 0) ? 0 : 128);
+        transform_rotate_plane(s, pw, ph, pw, d + (y >> sh) * ds + (x >> sh), ds, angle);
+        s += pw * ph;
+        d += ds * (dh >> sh);
+    }
+    return 1;
+}
+
+int transform_output_rect(int dw, int dh, int angle, int *x, int *y, int *w, int *h) {
+    *x = *y = 0;
+    *w = dw;
+    *h = dh;
+    if (angle == TRANSFORM_ROT90 || angle == TRANSFORM_ROT270) {
+        // the picture is dh x dw on its side
+        if (dw > dh) {
+            *w = (int)((long long)dh * dh / dw) & ~1;
+        } else {
+            *h = (int)((long long)dw * dw / dh) & ~1;
+        }
+        if (*w < 2 || *h < 2)
+            return 0;
+        *x = ((dw - *w) / 2) & ~1;
+        *y = ((dh - *h) / 2) & ~1;
+    }
+    return 1;
+}
+
+void transform_letterbox_yuv420(BYTE *dst, int dw, int dh, int x, int y, int w, int h) {
+    fill_border(dst, dw, dw, dh, x, y, w, h, 0);
+    dst += dw * dh;
+    fill_border(dst, dw / 2, dw / 2, dh / 2, x / 2, y / 2, w / 2, h / 2, 128);
+    dst += dw * dh / 4;
+    fill_border(dst, dw / 2, dw / 2, dh / 2, x / 2, y / 2, w / 2, h / 2, 128);
+}
+
+/* n_out samples spread over n_src, pixel centres aligned */
+static void remap_axis(struct transform_tap_s *t, int n_out, int n_src, int stride, int flip) {
+    int i, pos, max = (n_src - 1) * 256;
+    for (i = 0; i < n_out; i++) {
+        pos = (int)(((2LL * i + 1) * n_src * 256 / n_out - 256) / 2);
+        if (flip)
+            pos = max - pos;
+        if (pos < 0)
+            pos = 0;
+        if (pos > max)
+            pos = max;
+
+        t[i].o0 = (pos >> 8) * stride;
+        t[i].o1 = (pos >> 8 < n_src - 1) ? t[i].o0 + stride : t[i].o0;
+        t[i].f  = pos & 255;
+    }
+}
+
+void transform_remap_fini(struct transform_remap_s *rm) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        free(rm->plane[i].rows);
+        free(rm->plane[i].cols);
+    }
+    memset(rm, 0, sizeof(*rm));
+}
+
+/* Build the tables for an sw x sh frame going to dw x dh turned by
+ * 'angle', into transform_output_rect(). Does nothing if the tables
+ * already match. */
+int transform_remap_init(struct transform_remap_s *rm, int sw, int sh, int dw, int dh, int angle) {
+    int i, x, y, w, h;
+
+    if (rm->plane[0].rows != NULL && rm->sw == sw && rm->sh == sh
+        && rm->dw == dw && rm->dh == dh && rm->angle == angle)
+        return 1;
+
+    transform_remap_fini(rm);
+    if ((sw | sh | dw | dh) & 1 || sw < 2 || sh < 2)
+        return 0;
+
+    if (!transform_output_rect(dw, dh, angle, &x, &y, &w, &h))
+        return 0;
+
+    rm->sw = sw;
+    rm->sh = sh;
+    rm->dw = dw;
+    rm->dh = dh;
+    rm->angle = angle;
+
+    for (i = 0; i < 3; i++) {
+        int s = (i == 0) ? 0 : 1;
+        int pw = sw >> s, ph = sh >> s;
+        struct transform_tap_s *rows, *cols;
+
+        rm->plane[i].x = x >> s;
+        rm->plane[i].y = y >> s;
+        rm->plane[i].w = w >> s;
+        rm->plane[i].h = h >> s;
+        rows = rm->plane[i].rows = (struct transform_tap_s *)malloc((h >> s) * sizeof(*rows));
+        cols = rm->plane[i].cols = (struct transform_tap_s *)malloc((w >> s) * sizeof(*cols));
+        if (rows == NULL || cols == NULL) {
+            transform_remap_fini(rm);
+            return 0;
+        }
+
+        switch (angle) {
+            case TRANSFORM_ROT90:
+                // dst(r, c) = src(c, w - 1 - r)
+                remap_axis(rows, h >> s, pw, 1, 1);
+                remap_axis(cols, w >> s, ph, pw, 0);
+                break;
+            case TRANSFORM_ROT180:
+                remap_axis(rows, h >> s, ph, pw, 1);
+                remap_axis(cols, w >> s, pw, 1, 1);
+                break;
+            case TRANSFORM_ROT270:
+                // dst(r, c) = src(h - 1 - c, r)
+                remap_axis(rows, h >> s, pw, 1, 0);
+                remap_axis(cols, w >> s, ph, pw, 1);
+                break;
+            default:
+                remap_axis(rows, h >> s, ph, pw, 0);
+                remap_axis(cols, w >> s, pw, 1, 0);
+        }
+    }
+    return 1;
+}
+
+/* Goes down the output in strips TILE columns wide: when rotating, a
+ * column of output pixels comes from neighbouring source pixels on a row,
+ * so the source lines one strip touches stay in cache. */
+static void remap_plane(const BYTE *src, BYTE *dst, int dstride,
+                        const struct transform_tap_s *rows, const struct transform_tap_s *cols, int w, int h)
+{
+    int r, c, c0, c1;
+    for (c0 = 0; c0 < w; c0 = c1) {
+        BYTE *d = dst;
+        c1 = (c0 + TILE < w) ? c0 + TILE : w;
+        for (r = 0; r < h; r++, d += dstride) {
+            const BYTE *a = src + rows[r].o0;
+            const BYTE *b = src + rows[r].o1;
+            int rf = rows[r].f;
+
+            for (c = c0; c < c1; c++) {
+                int o0 = cols[c].o0, o1 = cols[c].o1, cf = cols[c].f;
+                int top = a[o0] * (256 - cf) + a[o1] * cf;
+                int bot = b[o0] * (256 - cf) + b[o1] * cf;
+                d[c] = (BYTE)((top * (256 - rf) + bot * rf + 32768) >> 16);
+            }
+        }
+    }
+}
+
+void transform_remap(const struct transform_remap_s *rm, const BYTE *src, BYTE *dst) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        int s = (i == 0) ? 0 : 1;
+        int dw = rm->dw >> s, dh = rm->dh >> s;
+
+        fill_border(dst, dw, dw, dh, rm->plane[i].x, rm->plane[i].y, rm->plane[i].w, rm->plane[i].h,
+            (i == 0) ? 0 : 128);
+        remap_plane(src, dst + rm->plane[i].y * dw + rm->plane[i].x, dw,
+            rm->plane[i].rows, rm->plane[i].cols, rm->plane[i].w, rm->plane[i].h);
+
+        src += (rm->sw >> s) * (rm->sh >> s);
+        dst += dw * dh;
+    }
+}
@@ -0,0 +1,67 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+typedef unsigned char BYTE;
+
+/* Rotations, numbered like decoder_rotate() steps through them.
+ * ROT90 turns the picture counter-clockwise, ROT270 clockwise. */
+#define TRANSFORM_NONE   0
+#define TRANSFORM_ROT90  1
+#define TRANSFORM_ROT180 2
+#define TRANSFORM_ROT270 3
+
+#define TRANSFORM_SIMD_NONE 0
+#define TRANSFORM_SIMD_SSE2 1
+#define TRANSFORM_SIMD_AVX2 2
+
+int  transform_simd_level(void);
+void transform_set_simd_level(int level);
+const char *transform_simd_name(int level);
+
+/* Exact rotation of one 8-bit plane of w x h pixels. The result is h x w
+ * for ROT90/ROT270. src and dst must not overlap. */
+void transform_rotate_plane(const BYTE *src, int w, int h, int sstride,
+                            BYTE *dst, int dstride, int angle);
+
+/* Rotate a w x h YUV420 frame into a dw x dh one, centred, with black
+ * borders around it if the rotated frame is smaller. */
+int  transform_rotate_yuv420(const BYTE *src, int w, int h, BYTE *dst, int dw, int dh, int angle);
+
+/* Where a dw x dh output shows the picture turned by 'angle': all of it
+ * for 0/180, and for 90/270 the upright picture on its side, shrunk to
+ * fit and centred. The rectangle is on even coordinates. */
+int  transform_output_rect(int dw, int dh, int angle, int *x, int *y, int *w, int *h);
+
+/* Paint the YUV420 frame black outside the x, y, w, h rectangle */
+void transform_letterbox_yuv420(BYTE *dst, int dw, int dh, int x, int y, int w, int h);
+
+/* Scale + rotate in one bilinear pass. For every output row and column of
+ * each plane a tap holds the two source offsets it sits between and the
+ * 8-bit weight of the second one, so a frame is a single gather. */
+struct transform_tap_s {
+ int o0, o1;
+ int f;
+};
+
+struct transform_remap_s {
+ int sw, sh, dw, dh, angle;
+ struct {
+  int x, y, w, h;       /* where the picture lands in the output plane */
+  struct transform_tap_s *rows, *cols;
+ } plane[3];
+};
+
+int  transform_remap_init(struct transform_remap_s *rm, int sw, int sh, int dw, int dh, int angle);
+void transform_remap_fini(struct transform_remap_s *rm);
+void transform_remap(const struct transform_remap_s *rm, const BYTE *src, BYTE *dst);
+
+#endif
@@ -0,0 +1,591 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "capture.h"
+#include "decoder.h"
+#include "trace.h"
+#include "uring.h"
+
+/* A phone connection driven by the I/O thread. It lives on the stack of
+ * the thread that called uring_recv_stream(), which sleeps on 'done'. */
+struct uring_conn_s {
+ struct decoder_s *d;
+ SOCKET s;
+ int slot;              /* index in 'conns' and of the fixed buffer */
+ int fixed;             /* the frame slots are registered */
+ struct jpg_frame_s *f;
+ BYTE hdr[4];
+ unsigned hdr_got;
+ unsigned len, got;
+ int payload;           /* receiving f, else the length prefix */
+ int refused;           /* never started, it can still go to readv */
+ int inflight;          /* a receive is queued, into hdr or f */
+ sem_t done;
+ struct uring_conn_s *next;
+};
+
+#define URING_ENTRIES 64
+#define WAKE_TAG 1     /* user_data of the eventfd read */
+#define STOP_TAG 2     /* and of the poll on connection_stop_fd() */
+#define TIMEOUT_TAG 3  /* and of the timeouts linked to the receives */
+
+/* A receive that sees nothing for this long is cancelled, as recv_buf_wait()
+ * gives up after it */
+static const struct __kernel_timespec recv_timeout = {
+    .tv_sec = RECV_TIMEOUT_MS / 1000,
+    .tv_nsec = (RECV_TIMEOUT_MS % 1000) * 1000000,
+};
+
+struct uring_s {
+ int fd;
+ int wake;              /* eventfd: new streams or stop */
+ uint64_t wake_count;
+
+ unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+ unsigned *cq_head, *cq_tail, *cq_mask;
+ struct io_uring_sqe *sqes;
+ struct io_uring_cqe *cqes;
+ void *sq_ptr, *cq_ptr;
+ size_t sq_size, cq_size, sqes_size;
+ unsigned to_submit;
+ int sparse;            /* fixed buffers can be registered one at a time */
+ int stop_armed;
+
+ pthread_t thread;
+ pthread_mutex_t lock;
+ struct uring_conn_s *pending;
+ struct uring_conn_s *conns[URING_MAX_CONNS];
+ int active;
+ int stopping;
+ int started;
+ int failed;            /* no ring, or the I/O thread gave up on it */
+};
+
+static struct uring_s ring = { .fd = -1, .wake = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static int ring_map(struct io_uring_params *p) {
+    ring.sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring.cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        return 0;
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+            return 0;
+    }
+    ring.sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        return 0;
+
+    ring.sq_head  = (unsigned*)((char*)ring.sq_ptr + p->sq_off.head);
+    ring.sq_tail  = (unsigned*)((char*)ring.sq_ptr + p->sq_off.tail);
+    ring.sq_mask  = (unsigned*)((char*)ring.sq_ptr + p->sq_off.ring_mask);
+    ring.sq_array = (unsigned*)((char*)ring.sq_ptr + p->sq_off.array);
+    ring.cq_head  = (unsigned*)((char*)ring.cq_ptr + p->cq_off.head);
+    ring.cq_tail  = (unsigned*)((char*)ring.cq_ptr + p->cq_off.tail);
+    ring.cq_mask  = (unsigned*)((char*)ring.cq_ptr + p->cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe*)((char*)ring.cq_ptr + p->cq_off.cqes);
+    return 1;
+}
+
+static void ring_unmap(void) {
+    if (ring.sqes != NULL && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != NULL && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+        munmap(ring.cq_ptr, ring.cq_size);
+    if (ring.sq_ptr != NULL && ring.sq_ptr != MAP_FAILED)
+        munmap(ring.sq_ptr, ring.sq_size);
+    ring.sqes = NULL;
+    ring.sq_ptr = ring.cq_ptr = NULL;
+}
+
+/* I/O thread: the next free submission entry. There are more of them than
+ * can ever be in flight, two per connection (the receive and its timeout),
+ * the eventfd read and the stop poll. */
+static struct io_uring_sqe *ring_sqe(void) {
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned*)ring.sq_tail, tail + 1, memory_order_release);
+    ring.to_submit++;
+    return sqe;
+}
+
+static void arm_wake(void) {
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring.wake;
+    sqe->addr = (uintptr_t)&ring.wake_count;
+    sqe->len = sizeof(ring.wake_count);
+    sqe->user_data = WAKE_TAG;
+}
+
+/* Fires on connection_stop(), to end every stream at once */
+static void arm_stop(void) {
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = connection_stop_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = STOP_TAG;
+    ring.stop_armed = 1;
+}
+
+/* Bounds the receive just submitted */
+static void link_timeout(struct io_uring_sqe *recv) {
+    struct io_uring_sqe *sqe;
+
+    recv->flags |= IOSQE_IO_LINK;
+    sqe = ring_sqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&recv_timeout;
+    sqe->len = 1;
+    sqe->user_data = TIMEOUT_TAG;
+}
+
+/* The length prefix, with MSG_WAITALL so it normally takes one go */
+static void submit_header(struct uring_conn_s *c) {
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->s;
+    sqe->addr = (uintptr_t)(c->hdr + c->hdr_got);
+    sqe->len = sizeof(c->hdr) - c->hdr_got;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = (uintptr_t)c;
+    c->inflight = 1;
+    link_timeout(sqe);
+}
+
+/* The rest of the frame, straight into its slot */
+static void submit_payload(struct uring_conn_s *c) {
+    struct io_uring_sqe *sqe = ring_sqe();
+    sqe->fd = c->s;
+    sqe->addr = (uintptr_t)(c->f->data + c->got);
+    sqe->len = c->len - c->got;
+    sqe->user_data = (uintptr_t)c;
+    if (c->fixed) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = c->slot;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    c->inflight = 1;
+    link_timeout(sqe);
+}
+
+static int register_slot(struct uring_conn_s *c, BYTE *base, size_t size) {
+    struct iovec iov = { .iov_base = base, .iov_len = size };
+    struct io_uring_rsrc_update2 up = {0};
+
+    if (!ring.sparse || ring.fd < 0)
+        return 0;
+    up.offset = c->slot;
+    up.data = (uintptr_t)&iov;
+    up.nr = 1;
+    return sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) == 1;
+}
+
+static void conn_start(struct uring_conn_s *c) {
+    BYTE *base;
+    size_t size;
+    int i;
+
+    for (i = 0; i < URING_MAX_CONNS && ring.conns[i] != NULL; i++)
+        ;
+    if (i == URING_MAX_CONNS) {
+        errprint("io_uring: too many connections\n");
+        c->refused = 1;
+        sem_post(&c->done);
+        return;
+    }
+    ring.conns[i] = c;
+    c->slot = i;
+    decoder_get_frame_memory(c->d, &base, &size);
+    // pinning the slots can fail with a low RLIMIT_MEMLOCK, the frames
+    // are then received without the fixed buffer
+    c->fixed = register_slot(c, base, size);
+    dbgprint("io_uring: stream %d on fd %d, fixed=%d\n", i, c->s, c->fixed);
+    submit_header(c);
+    // after a stop it fires right away and ends this one too
+    if (!ring.stop_armed)
+        arm_stop();
+}
+
+/* I/O thread: the stop fd is readable. Shutting the sockets down completes
+ * their receives with 0, and so ends the streams. */
+static void conns_stop(void) {
+    int i;
+
+    ring.stop_armed = 0;
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        if (ring.conns[i] != NULL)
+            shutdown(ring.conns[i]->s, SHUT_RDWR);
+    }
+}
+
+static void conn_end(struct uring_conn_s *c) {
+    if (c->fixed)
+        register_slot(c, NULL, 0);
+    ring.conns[c->slot] = NULL;
+    sem_post(&c->done);
+}
+
+/* I/O thread: a receive of 'c' completed with 'res' */
+static void conn_complete(struct uring_conn_s *c, int res) {
+    unsigned frameLen;
+
+    if (res <= 0 || connection_stopped()) {
+        if (res == -ECANCELED && !connection_stopped())
+            errprint("nothing from the phone in %d ms\n", RECV_TIMEOUT_MS);
+        dbgprint("io_uring: stream %d ends, res=%d\n", c->slot, res);
+        conn_end(c);
+        return;
+    }
+
+    if (!c->payload) {
+        c->hdr_got += res;
+        if (c->hdr_got < sizeof(c->hdr)) {
+            submit_header(c);
+            return;
+        }
+        make_int4(frameLen, c->hdr[0], c->hdr[1], c->hdr[2], c->hdr[3]);
+        c->f = decoder_get_next_frame(c->d);
+        if (!decoder_begin_frame(c->d, c->f, frameLen)) {
+            conn_end(c);
+            return;
+        }
+        c->len = frameLen;
+        c->got = 0;
+        c->payload = 1;
+        submit_payload(c);
+        return;
+    }
+
+    c->got += res;
+    decoder_frame_progress(c->d, c->f, c->got);
+    if (c->got < c->len) {
+        submit_payload(c);
+        return;
+    }
+    if (capture_active())
+        capture_frame(c->f->data, c->len, c->f->ts[FRAME_FIRST_BYTE]);
+    decoder_put_next_frame(c->d);
+    c->payload = 0;
+    c->hdr_got = 0;
+    submit_header(c);
+}
+
+/* The connection a completion or submission is for, if any */
+static struct uring_conn_s *tag_conn(uint64_t user_data) {
+    return (user_data > TIMEOUT_TAG) ? (struct uring_conn_s*)(uintptr_t)user_data : NULL;
+}
+
+static int conns_inflight(void) {
+    int i;
+
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        if (ring.conns[i] != NULL && ring.conns[i]->inflight)
+            return 1;
+    }
+    return 0;
+}
+
+/* I/O thread: takes whatever completions there are, noting the receives
+ * that are done, and nothing else */
+static void reap_inflight(void) {
+    struct uring_conn_s *c;
+    unsigned head, tail;
+
+    head = *ring.cq_head;
+    tail = atomic_load_explicit((_Atomic unsigned*)ring.cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        if ((c = tag_conn(ring.cqes[head & *ring.cq_mask].user_data)) != NULL)
+            c->inflight = 0;
+    }
+    atomic_store_explicit((_Atomic unsigned*)ring.cq_head, head, memory_order_release);
+}
+
+/* I/O thread, the ring failed with the sockets shut down: waits for the
+ * receives still in the kernel, which write to the streams' stacks and
+ * slots. Those that never left the queue are taken back. Without
+ * io_uring_enter() it cancels everything and watches the completion queue
+ * for as long as a receive can take. FALSE if some are still out. */
+static int ring_reap(void) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)ring.sq_head, memory_order_acquire);
+    unsigned tail = *ring.sq_tail;
+    struct io_uring_sync_cancel_reg cancel = {0};
+    struct uring_conn_s *c;
+    int n, waited = 0, enter = 1;
+
+    for (; head != tail; head++) {
+        if ((c = tag_conn(ring.sqes[ring.sq_array[head & *ring.sq_mask]].user_data)) != NULL)
+            c->inflight = 0;
+    }
+    atomic_store_explicit((_Atomic unsigned*)ring.sq_tail, head, memory_order_release);
+    ring.to_submit = 0;
+
+    while (conns_inflight()) {
+        if (enter) {
+            n = sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS);
+            if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                enter = 0;
+                cancel.fd = -1;
+                cancel.flags = IORING_ASYNC_CANCEL_ANY;
+                cancel.timeout.tv_sec = cancel.timeout.tv_nsec = -1;
+                if (sys_io_uring_register(ring.fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) < 0)
+                    dbgprint("io_uring: sync cancel failed, errno=%d\n", errno);
+            }
+        } else {
+            // every receive has its timeout linked
+            if (waited++ > RECV_TIMEOUT_MS + 1000)
+                return FALSE;
+            usleep(1000);
+        }
+        reap_inflight();
+    }
+    return TRUE;
+}
+
+/* I/O thread: the ring is unusable. Ends every stream it has or was about to
+ * get, once nothing is received for them any more, and sends the next ones
+ * to readv. */
+static void ring_failed(void) {
+    struct uring_conn_s *c, *next;
+    int i;
+
+    pthread_mutex_lock(&ring.lock);
+    ring.failed = 1;
+    c = ring.pending;
+    ring.pending = NULL;
+    pthread_mutex_unlock(&ring.lock);
+
+    conns_stop();
+    if (!ring_reap()) {
+        // tear it down, the kernel drops what is left with it
+        errprint("io_uring: receives still out, closing the ring\n");
+        ring_unmap();
+        close(ring.fd);
+        ring.fd = -1;
+    }
+    for (i = 0; i < URING_MAX_CONNS; i++) {
+        if (ring.conns[i] != NULL)
+            conn_end(ring.conns[i]);
+    }
+    for (; c != NULL; c = next) {
+        next = c->next;
+        c->refused = 1;
+        sem_post(&c->done);
+    }
+}
+
+static void *uring_thread_proc(void *args) {
+    struct uring_conn_s *c, *next;
+    unsigned head, tail;
+    int n, running = 1;
+    uint64_t t;
+
+    dbgprint("io_uring thread started\n");
+    arm_wake();
+    while (running) {
+        t = trace_begin();
+        n = sys_io_uring_enter(ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS);
+        trace_end("io_uring_enter", t);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            MSG_LASTERROR("io_uring_enter");
+            ring_failed();
+            break;
+        }
+        if (n > 0)
+            ring.to_submit -= (n < (int)ring.to_submit) ? (unsigned)n : ring.to_submit;
+
+        head = *ring.cq_head;
+        tail = atomic_load_explicit((_Atomic unsigned*)ring.cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (cqe->user_data == TIMEOUT_TAG)
+                continue;
+            if (cqe->user_data == STOP_TAG) {
+                conns_stop();
+                continue;
+            }
+            if ((c = tag_conn(cqe->user_data)) != NULL) {
+                c->inflight = 0;
+                conn_complete(c, cqe->res);
+                continue;
+            }
+
+            pthread_mutex_lock(&ring.lock);
+            c = ring.pending;
+            ring.pending = NULL;
+            running = !ring.stopping;
+            pthread_mutex_unlock(&ring.lock);
+            for (; c != NULL; c = next) {
+                next = c->next;
+                conn_start(c);
+            }
+            if (running)
+                arm_wake();
+        }
+        atomic_store_explicit((_Atomic unsigned*)ring.cq_head, head, memory_order_release);
+    }
+    dbgprint("io_uring thread end\n");
+    return 0;
+}
+
+/* Sets the ring up and starts the I/O thread, the first time it is needed */
+static int uring_start(void) {
+    struct io_uring_params p;
+    struct io_uring_rsrc_register reg = {0};
+
+    if (ring.failed)
+        return 0;
+    if (ring.started)
+        return 1;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        errprint("io_uring not available (errno=%d), using readv\n", errno);
+        goto _error_out;
+    }
+    if (!ring_map(&p))
+        goto _error_out;
+
+    // an empty table, each stream fills in its own entry
+    reg.nr = URING_MAX_CONNS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    ring.sparse = (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0);
+    dbgprint("io_uring: sparse buffers %d\n", ring.sparse);
+
+    ring.wake = eventfd(0, EFD_CLOEXEC);
+    if (ring.wake < 0)
+        goto _error_out;
+    ring.stopping = 0;
+    ring.stop_armed = 0;
+    if (pthread_create(&ring.thread, NULL, uring_thread_proc, NULL) != 0)
+        goto _error_out;
+    pthread_setname_np(ring.thread, "io_uring");
+    ring.started = 1;
+    return 1;
+
+_error_out:
+    if (ring.wake >= 0) close(ring.wake);
+    ring.wake = -1;
+    ring_unmap();
+    if (ring.fd >= 0) close(ring.fd);
+    ring.fd = -1;
+    ring.failed = 1;
+    return 0;
+}
+
+int uring_enabled(void) {
+    const char *env = getenv("DROIDCAM_RECV_BACKEND");
+    int failed;
+
+    pthread_mutex_lock(&ring.lock);
+    failed = ring.failed;
+    pthread_mutex_unlock(&ring.lock);
+    return !failed && env != NULL && strcmp(env, "uring") == 0;
+}
+
+int uring_recv_stream(struct decoder_s *d, SOCKET s) {
+    struct uring_conn_s c = {0};
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ring.lock);
+    if (!uring_start()) {
+        pthread_mutex_unlock(&ring.lock);
+        return FALSE;
+    }
+    c.d = d;
+    c.s = s;
+    sem_init(&c.done, 0, 0);
+    c.next = ring.pending;
+    ring.pending = &c;
+    ring.active++;
+    pthread_mutex_unlock(&ring.lock);
+    if (write(ring.wake, &one, sizeof(one)) < 0)
+        MSG_LASTERROR("Error: eventfd");
+
+    while (sem_wait(&c.done) < 0 && errno == EINTR)
+        ;
+    sem_destroy(&c.done);
+
+    pthread_mutex_lock(&ring.lock);
+    ring.active--;
+    pthread_mutex_unlock(&ring.lock);
+    return !c.refused;
+}
+
+void uring_fini(void) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ring.lock);
+    if (!ring.started || ring.active > 0) {
+        pthread_mutex_unlock(&ring.lock);
+        return;
+    }
+    ring.stopping = 1;
+    pthread_mutex_unlock(&ring.lock);
+    if (write(ring.wake, &one, sizeof(one)) < 0)
+        MSG_LASTERROR("Error: eventfd");
+    pthread_join(ring.thread, NULL);
+
+    close(ring.wake);
+    ring.wake = -1;
+    ring_unmap();
+    if (ring.fd >= 0) close(ring.fd);
+    ring.fd = -1;
+    ring.started = 0;
+}
@@ -0,0 +1,32 @@
+/* DroidCam & DroidCamX (C) 2010-
+ * https://github.com/aramg
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * Use at your own risk. See README file for more details.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "connection.h"
+
+/* io_uring receive backend, picked with DROIDCAM_RECV_BACKEND=uring.
+ * One I/O thread receives the frames of every connected phone. The frame
+ * slots of each stream are registered as a fixed buffer, so the payloads
+ * are read straight into them. */
+#define URING_MAX_CONNS 16
+
+int  uring_enabled(void);
+
+/* Hands the stream on 's' to the I/O thread and returns once the
+ * connection is gone, or FALSE if io_uring is not available or the I/O
+ * thread could not take it; the stream is then left to readv */
+struct decoder_s;
+int  uring_recv_stream(struct decoder_s *d, SOCKET s);
+
+/* Stops the I/O thread, once no stream is using it */
+void uring_fini(void);
+
+#endif
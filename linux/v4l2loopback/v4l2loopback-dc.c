@@ -129,8 +129,7 @@ MODULE_LICENSE("GPL");
  *   one opener for the producer and one opener for the consumer
  */
 #define MAX_OPENERS 8;
-#define MAX_DEVICES 1
-#define DEVICES     1
+#define MAX_DEVICES 8
 
 /* format specifications */
 #define V4L2LOOPBACK_SIZE_MIN_WIDTH   48
@@ -150,6 +149,10 @@ static int height = V4L2LOOPBACK_SIZE_DEFAULT_HEIGHT;
 module_param(height, int, S_IRUGO);
 MODULE_PARM_DESC(height, "frame height");
 
+static int devices = 1;
+module_param(devices, int, S_IRUGO);
+MODULE_PARM_DESC(devices, "number of devices to create, one per phone (1-8)");
+
 /* control IDs */
 #define CID_KEEP_FORMAT        (V4L2_CID_PRIVATE_BASE+0)
 #define CID_SUSTAIN_FRAMERATE  (V4L2_CID_PRIVATE_BASE+1)
@@ -541,7 +544,7 @@ v4l2loopback_cd2dev  (struct device*cd)
   struct video_device *loopdev = to_video_device(cd);
   priv_ptr ptr = (priv_ptr)video_get_drvdata(loopdev);
   int nr = ptr->devicenr;
-  if(nr<0 || nr>=DEVICES){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
+  if(nr<0 || nr>=devices){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
   return devs[nr];
 }
 
@@ -551,14 +554,14 @@ v4l2loopback_getdevice        (struct file*f)
   struct video_device *loopdev = video_devdata(f);
   priv_ptr ptr = (priv_ptr)video_get_drvdata(loopdev);
   int nr = ptr->devicenr;
-  if(nr<0 || nr>=DEVICES){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
+  if(nr<0 || nr>=devices){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
   return devs[nr];
 }
 
 static struct v4l2_loopback_device*
 v4l2loopback_getdevice_internal (int nr)
 {
-  if(nr<0 || nr>=DEVICES){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
+  if(nr<0 || nr>=devices){printk(KERN_ERR "v4l2-loopback: illegal device %d\n",nr);return NULL;}
   return devs[nr];
 }
 
@@ -1538,7 +1541,14 @@ vidioc_qbuf         (struct file *file,
     return 0;
   case V4L2_BUF_TYPE_VIDEO_OUTPUT:
     dprintkrw("output QBUF pos: %d index: %d\n", dev->write_position, index);
-    get_timestamp(&b->buffer.timestamp);
+    /* keep the writer's timestamp, it knows when the frame was captured */
+    if (buf->timestamp.tv_sec || buf->timestamp.tv_usec) {
+      b->buffer.timestamp = buf->timestamp;
+    } else {
+      get_timestamp(&b->buffer.timestamp);
+    }
+    /* same as v4l2_loopback_write(), so readers see the frame order */
+    b->buffer.sequence = dev->write_position;
     set_done(b);
     buffer_written(dev, b);
     wake_up_all(&dev->read_event);
@@ -2383,7 +2393,7 @@ free_devices        (void)
 {
   int i;
   MARK();
-  for(i=0; i<DEVICES; i++) {
+  for(i=0; i<devices; i++) {
     if(NULL!=devs[i]) {
       free_buffers(devs[i]);
       v4l2loopback_remove_sysfs(devs[i]->vdev);
@@ -2404,9 +2414,13 @@ init_module         (void)
   MARK();
 
   zero_devices();
+  if (devices < 1 || devices > MAX_DEVICES) {
+    printk(KERN_ERR "v4l2loopback: devices must be 1-%d, not %d\n", MAX_DEVICES, devices);
+    return -EINVAL;
+  }
 
   /* kfree on module release */
-  for(i=0; i<DEVICES; i++) {
+  for(i=0; i<devices; i++) {
     dprintk("creating v4l2loopback-device #%d\n", i);
     devs[i] = kzalloc(sizeof(*devs[i]), GFP_KERNEL);
     if (devs[i] == NULL) {